@@ -2,12 +2,15 @@
 
 #include <glib.h>
 
+/* Kernel weights are fixed point numbers with this many fractional bits */
+#define GAUSSIAN_KERNEL_SHIFT 14
+
 struct gaussian_kernel {
-  gdouble *kernel;
+  gint32 *kernel;
+  gint radius;
   gint size;
   gdouble sigma;
-  gdouble sum;
 };
 
-struct gaussian_kernel *gaussian_kernel(gint width, gdouble sigma);
+struct gaussian_kernel *gaussian_kernel(gint radius, gdouble sigma);
 void gaussian_kernel_free(gpointer data);
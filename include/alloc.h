@@ -0,0 +1,32 @@
+#pragma once
+
+#include <glib.h>
+
+/*
+ * Built with -Dalloc-check=true, heap allocations made by the main thread are
+ * counted and the parts of event handlers wrapped in these macros warn when
+ * they allocate. Arrays growing geometrically, such as the points of a brush
+ * stroke, show up once in a while. Otherwise the macros expand to nothing.
+ */
+#ifdef SWAPPY_ALLOC_CHECK
+
+struct alloc_check {
+  const gchar *name;
+  guint64 events;
+  guint64 allocating_events;
+};
+
+guint64 alloc_check_count(void);
+void alloc_check_report(struct alloc_check *check, guint64 start);
+
+#define ALLOC_CHECK_BEGIN(handler)                         \
+  static struct alloc_check alloc_check = {handler, 0, 0}; \
+  guint64 alloc_check_start = alloc_check_count()
+#define ALLOC_CHECK_END() alloc_check_report(&alloc_check, alloc_check_start)
+
+#else
+
+#define ALLOC_CHECK_BEGIN(handler)
+#define ALLOC_CHECK_END()
+
+#endif
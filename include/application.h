@@ -27,6 +27,8 @@ void draw_area_button_release_handler(GtkWidget *widget, GdkEventButton *event,
                                       struct swappy_state *state);
 void draw_area_motion_notify_handler(GtkWidget *widget, GdkEventMotion *event,
                                      struct swappy_state *state);
+gboolean draw_area_scroll_handler(GtkWidget *widget, GdkEventScroll *event,
+                                  struct swappy_state *state);
 
 void brush_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 void text_clicked_handler(GtkWidget *widget, struct swappy_state *state);
@@ -34,6 +36,7 @@ void rectangle_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 void ellipse_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 void arrow_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 void blur_clicked_handler(GtkWidget *widget, struct swappy_state *state);
+void pixelate_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 
 void copy_clicked_handler(GtkWidget *widget, struct swappy_state *state);
 void save_clicked_handler(GtkWidget *widget, struct swappy_state *state);
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "swappy.h"
+
+GThreadPool *blur_pool_new(guint nb_threads);
+cairo_surface_t *blur_surface(cairo_surface_t *surface, double x, double y,
+                              double width, double height,
+                              enum swappy_blur_algorithm algorithm,
+                              guint radius, GThreadPool *pool);
+struct blur_job *blur_surface_async(cairo_surface_t *surface, double x,
+                                    double y, double width, double height,
+                                    enum swappy_blur_algorithm algorithm,
+                                    guint radius, GThreadPool *pool,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data);
+cairo_surface_t *blur_surface_finish(GAsyncResult *result, GError **error);
+cairo_surface_t *blur_job_wait(struct blur_job *job);
+void blur_job_unref(struct blur_job *job);
+double blur_get_reach(cairo_surface_t *surface,
+                      enum swappy_blur_algorithm algorithm, guint radius);
+void blur_wait_tasks(void);
+cairo_surface_t *blur_surface_preview(cairo_surface_t *surface,
+                                      struct swappy_box *area,
+                                      enum swappy_blur_algorithm algorithm,
+                                      guint radius);
@@ -5,3 +5,6 @@
 bool box_parse(struct swappy_box *box, const char *str);
 bool is_empty_box(struct swappy_box *box);
 bool intersect_box(struct swappy_box *a, struct swappy_box *b);
+bool contains_box(struct swappy_box *a, struct swappy_box *b);
+void union_box(struct swappy_box *a, struct swappy_box *b,
+               struct swappy_box *box);
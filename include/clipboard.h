@@ -3,3 +3,4 @@
 #include "swappy.h"
 
 bool clipboard_copy_drawing_area_to_selection(struct swappy_state *state);
+void clipboard_wait(struct swappy_state *state);
@@ -12,6 +12,11 @@
 #define CONFIG_AUTO_SAVE_DEFAULT false
 #define CONFIG_CUSTOM_COLOR_DEFAULT "rgba(193,125,17,1)"
 #define CONFIG_TRANSPARENT_DEFAULT false
+#define CONFIG_BLUR_THREADS_DEFAULT 0
+#define CONFIG_BLUR_ALGORITHM_DEFAULT SWAPPY_BLUR_ALGORITHM_GAUSSIAN
+#define CONFIG_BLUR_RADIUS_DEFAULT 8
+#define CONFIG_PNG_COMPRESSION_DEFAULT 1
+#define CONFIG_BRUSH_TOLERANCE_DEFAULT 0.0
 
 void config_load(struct swappy_state *state);
 void config_free(struct swappy_state *state);
@@ -14,6 +14,11 @@ void paint_update_temporary_str(struct swappy_state *state, char *event);
 void paint_update_temporary_text_clip(struct swappy_state *state, gdouble x,
                                       gdouble y);
 void paint_commit_temporary(struct swappy_state *state);
+void paint_brush_get_controls(struct swappy_paint_brush *brush, guint i,
+                              struct swappy_point *c1,
+                              struct swappy_point *c2);
+
+void paint_cancel_pending(struct swappy_paint *paint);
 
 void paint_free(gpointer data);
 void paint_free_all(struct swappy_state *state);
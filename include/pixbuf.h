@@ -2,12 +2,25 @@
 
 #include "swappy.h"
 
-GdkPixbuf *pixbuf_init_from_file(struct swappy_state *state);
-GdkPixbuf *pixbuf_get_from_state(struct swappy_state *state);
-void pixbuf_save_state_to_folder(GdkPixbuf *pixbuf, char *folder,
+gboolean pixbuf_init_from_file(struct swappy_state *state);
+gboolean pixbuf_is_loaded(struct swappy_state *state);
+void pixbuf_wait_loaded(struct swappy_state *state);
+struct swappy_export *pixbuf_export_get(struct swappy_state *state);
+struct swappy_export *pixbuf_export_ref(struct swappy_export *export);
+void pixbuf_export_unref(struct swappy_export *export);
+void pixbuf_export_detach(struct swappy_state *state);
+GdkPixbuf *pixbuf_export_get_pixbuf(struct swappy_export *export);
+gboolean pixbuf_export_write_png(struct swappy_export *export,
+                                 GOutputStream *out, gboolean cache,
+                                 GError **error);
+void pixbuf_save_state_to_folder(struct swappy_state *state,
+                                 struct swappy_export *export, char *folder,
                                  char *filename_format);
-void pixbuf_save_to_file(GdkPixbuf *pixbuf, char *file);
-void pixbuf_save_to_stdout(GdkPixbuf *pixbuf);
-void pixbuf_scale_surface_from_widget(struct swappy_state *state,
-                                      GtkWidget *widget);
+void pixbuf_save_to_file(struct swappy_state *state,
+                         struct swappy_export *export, char *file);
+void pixbuf_save_to_stdout(struct swappy_state *state,
+                           struct swappy_export *export);
+void pixbuf_save_wait(struct swappy_state *state);
+gboolean pixbuf_scale_surface_from_widget(struct swappy_state *state,
+                                          GtkWidget *widget);
 void pixbuf_free(struct swappy_state *state);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "swappy.h"
+
+cairo_surface_t *pixelate_surface(cairo_surface_t *surface, double x, double y,
+                                  double width, double height);
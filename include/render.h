@@ -3,3 +3,13 @@
 #include "swappy.h"
 
 void render_state(struct swappy_state *state);
+void render_schedule(struct swappy_state *state);
+void render_schedule_redraw(struct swappy_state *state);
+void render_flush(struct swappy_state *state);
+void render_drag_begin(struct swappy_state *state);
+void render_drag_end(struct swappy_state *state);
+void render_invalidate_committed_layer(struct swappy_state *state);
+void render_finish_blurs(struct swappy_state *state);
+void render_image_area(struct swappy_state *state, struct swappy_box *area);
+void render_resize_display(struct swappy_state *state, gint width,
+                           gint height, gint scale);
@@ -17,6 +17,16 @@
 #define SWAPPY_TRANSPARENCY_MIN 5
 #define SWAPPY_TRANSPARENCY_MAX 95
 
+#define SWAPPY_BLUR_THREADS_MAX 64
+
+#define SWAPPY_PNG_COMPRESSION_MIN 0
+#define SWAPPY_PNG_COMPRESSION_MAX 9
+
+#define SWAPPY_BLUR_RADIUS_MIN 1
+#define SWAPPY_BLUR_RADIUS_MAX 128
+
+#define SWAPPY_BRUSH_TOLERANCE_MAX 16
+
 enum swappy_paint_type {
   SWAPPY_PAINT_MODE_BRUSH = 0, /* Brush mode to draw arbitrary shapes */
   SWAPPY_PAINT_MODE_TEXT,      /* Mode to draw texts */
@@ -24,6 +34,7 @@ enum swappy_paint_type {
   SWAPPY_PAINT_MODE_ELLIPSE,   /* Ellipse shapes */
   SWAPPY_PAINT_MODE_ARROW,     /* Arrow shapes */
   SWAPPY_PAINT_MODE_BLUR,      /* Blur mode */
+  SWAPPY_PAINT_MODE_PIXELATE,  /* Pixelate mode */
 };
 
 enum swappy_paint_shape_operation {
@@ -31,6 +42,11 @@ enum swappy_paint_shape_operation {
   SWAPPY_PAINT_SHAPE_OPERATION_FILL,       /* Used to fill the shape */
 };
 
+enum swappy_blur_algorithm {
+  SWAPPY_BLUR_ALGORITHM_GAUSSIAN = 0, /* Separable gaussian kernel */
+  SWAPPY_BLUR_ALGORITHM_BOX,          /* Three running sum box passes */
+};
+
 enum swappy_text_mode {
   SWAPPY_TEXT_MODE_EDIT = 0,
   SWAPPY_TEXT_MODE_DONE,
@@ -41,6 +57,13 @@ struct swappy_point {
   gdouble y;
 };
 
+struct swappy_box {
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+};
+
 struct swappy_paint_text {
   double r;
   double g;
@@ -74,13 +97,33 @@ struct swappy_paint_brush {
   double b;
   double a;
   double w;
-  GList *points;
+  /* Array of struct swappy_point, in the order they were drawn */
+  GArray *points;
+  /* Bounding box of the points, grown as they are added */
+  struct swappy_point min;
+  struct swappy_point max;
+  /* Points already rasterized into brush_layer while the stroke is drawn */
+  guint rendered;
+  /* Points are the knots of a Catmull-Rom spline rather than a polyline */
+  gboolean smooth;
 };
 
 struct swappy_paint_blur {
   struct swappy_point from;
   struct swappy_point to;
   cairo_surface_t *surface;
+  cairo_surface_t *preview;
+  /* Area of the image preview was computed for */
+  struct swappy_box preview_box;
+  /* Set while the full quality blur is computed in the background */
+  GCancellable *cancellable;
+  struct blur_job *job;
+};
+
+struct swappy_paint_pixelate {
+  struct swappy_point from;
+  struct swappy_point to;
+  cairo_surface_t *surface;
 };
 
 struct swappy_paint {
@@ -92,16 +135,10 @@ struct swappy_paint {
     struct swappy_paint_shape shape;
     struct swappy_paint_text text;
     struct swappy_paint_blur blur;
+    struct swappy_paint_pixelate pixelate;
   } content;
 };
 
-struct swappy_box {
-  int32_t x;
-  int32_t y;
-  int32_t width;
-  int32_t height;
-};
-
 struct swappy_state_settings {
   double r;
   double g;
@@ -112,6 +149,24 @@ struct swappy_state_settings {
   int32_t tr;
 };
 
+struct swappy_view {
+  /* 0 fits the image in the drawing area, every level zooms in further */
+  gint zoom_level;
+  /* Image coordinates shown at the top left corner of the drawing area */
+  gdouble x;
+  gdouble y;
+
+  /* Tiles of the zoomed image rendered so far, see view.c */
+  GHashTable *tiles;
+  gsize tiles_size;
+  guint64 frame;
+
+  /* Pointer position the image is being dragged from */
+  gboolean panning;
+  gdouble pan_x;
+  gdouble pan_y;
+};
+
 struct swappy_state_ui {
   gboolean panel_toggled;
 
@@ -134,6 +189,7 @@ struct swappy_state_ui {
   GtkRadioButton *ellipse;
   GtkRadioButton *arrow;
   GtkRadioButton *blur;
+  GtkRadioButton *pixelate;
 
   GtkRadioButton *red;
   GtkRadioButton *green;
@@ -166,6 +222,28 @@ struct swappy_config {
   gboolean early_exit;
   gboolean auto_save;
   char *custom_color;
+  guint32 blur_threads;
+  enum swappy_blur_algorithm blur_algorithm;
+  guint32 blur_radius;
+  guint32 png_compression;
+  gdouble brush_tolerance;
+};
+
+/*
+ * A rendered frame to export. It is shared by every sink (files,
+ * stdout, clipboard) so that the PNG is encoded at most once, by whichever
+ * thread needs it first.
+ */
+struct swappy_export {
+  gint ref_count;
+  /* Value of render_generation the frame was taken at */
+  guint64 generation;
+  guint32 compression;
+  /* rendering_surface at that time, see pixbuf_export_detach() */
+  cairo_surface_t *surface;
+  /* Protects png, which is NULL until encoded */
+  GMutex mutex;
+  GBytes *png;
 };
 
 struct swappy_state {
@@ -174,19 +252,49 @@ struct swappy_state {
   struct swappy_state_ui *ui;
   struct swappy_config *config;
 
-  GdkPixbuf *original_image;
   cairo_surface_t *original_image_surface;
+  /* Rest of the image being decoded, NULL once it is fully loaded */
+  struct pixbuf_load *load;
   cairo_surface_t *rendering_surface;
 
-  gdouble scaling_factor;
+  /* Original image with all committed paints flattened on top of it */
+  cairo_surface_t *committed_surface;
+  /* Coverage of the brush stroke being drawn, and the area it spans */
+  cairo_surface_t *brush_layer;
+  struct swappy_box brush_layer_box;
+  /* Number of paints (oldest first) drawn into committed_surface, -1 when the
+   * surface needs to be rebuilt from scratch */
+  gint committed_paints_count;
+
+  /* rendering_surface scaled down to the drawing area, in screen pixels */
+  cairo_surface_t *display_surface;
+
+  /* Tick callback of the area rendering on the next frame, 0 when idle */
+  guint render_tick_id;
+  /* Set when the next tick has something to render */
+  gboolean render_scheduled;
+  /* Set while a paint is drawn or the view panned, the tick callback then
+   * stays installed */
+  gboolean render_dragging;
+  /* Set when the next tick has to draw the whole area again */
+  gboolean render_redraw;
+  /* Area of the image to render on top of what paints changed, see
+   * render_schedule() */
+  struct swappy_box render_damage;
+
+  /* Bumped every time rendering_surface changes */
+  guint64 render_generation;
+  /* Last exported frame, reused while render_generation is unchanged */
+  struct swappy_export *export;
+
+  struct swappy_view view;
 
   enum swappy_paint_type mode;
 
   /* Options */
   char *file_str;
   char *output_file;
-
-  char *temp_file_str;
+  gint png_compression;
 
   struct swappy_box *window;
   struct swappy_box *geometry;
@@ -194,9 +302,18 @@ struct swappy_state {
   GList *paints;
   GList *redo_paints;
   struct swappy_paint *temp_paint;
+  /* Area covered by temp_paint when it was last rendered */
+  struct swappy_box temp_paint_box;
 
   struct swappy_state_settings settings;
 
+  /* Workers blurring bands of rows in parallel, NULL when single threaded */
+  GThreadPool *blur_pool;
+  /* Single worker encoding and writing saved files, created on first save */
+  GThreadPool *save_pool;
+  /* Copies to the clipboard still in progress, see clipboard_wait() */
+  guint clipboard_copies;
+
   int argc;
   char **argv;
 };
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "swappy.h"
+
+void view_screen_to_image(struct swappy_state *state, gdouble screen_x,
+                          gdouble screen_y, gdouble *image_x, gdouble *image_y);
+void view_zoom(struct swappy_state *state, gint levels, gdouble screen_x,
+               gdouble screen_y);
+void view_pan(struct swappy_state *state, gdouble dx, gdouble dy);
+void view_draw(struct swappy_state *state, cairo_t *cr);
+void view_invalidate_area(struct swappy_state *state,
+                          struct swappy_box *damage);
+void view_invalidate(struct swappy_state *state);
+void view_free(struct swappy_state *state);
@@ -3,27 +3,39 @@
 #include <glib.h>
 #include <math.h>
 
-struct gaussian_kernel *gaussian_kernel(int width, double sigma) {
-  double sum = 0;
-  gint size = width * width + 1;
-  double *kernel = g_new0(double, size);
+/*
+ * Build a one dimensional gaussian kernel of `2 * radius + 1` taps. Weights are
+ * normalized so that they sum up to exactly `1 << GAUSSIAN_KERNEL_SHIFT`,
+ * blurring a flat area is then lossless.
+ */
+struct gaussian_kernel *gaussian_kernel(gint radius, gdouble sigma) {
+  gint size = 2 * radius + 1;
+  gdouble *weights = g_new(gdouble, size);
+  gint32 *kernel = g_new(gint32, size);
   struct gaussian_kernel *gaussian = g_new(struct gaussian_kernel, 1);
-  for (gint y = 0; y < width; y++) {
-    for (gint x = 0; x < width; x++) {
-      double j = y - width;
-      double i = x - width;
-      double cell = ((1.0 / (2.0 * G_PI * sigma)) *
-                     exp((-(i * i + j * j)) / (2.0 * sigma * sigma))) *
-                    0xff;
-      kernel[y * width + x] = cell;
-      sum += cell;
-    }
+  gdouble sum = 0;
+  gint32 total = 0;
+
+  for (gint i = 0; i < size; i++) {
+    gdouble x = i - radius;
+    weights[i] = exp(-(x * x) / (2.0 * sigma * sigma));
+    sum += weights[i];
+  }
+
+  for (gint i = 0; i < size; i++) {
+    kernel[i] = (gint32)round(weights[i] / sum * (1 << GAUSSIAN_KERNEL_SHIFT));
+    total += kernel[i];
   }
 
+  // Give the rounding error to the center tap
+  kernel[radius] += (1 << GAUSSIAN_KERNEL_SHIFT) - total;
+
+  g_free(weights);
+
   gaussian->kernel = kernel;
+  gaussian->radius = radius;
   gaussian->size = size;
   gaussian->sigma = sigma;
-  gaussian->sum = sum;
 
   return gaussian;
 }
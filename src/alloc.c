@@ -0,0 +1,49 @@
+#include "alloc.h"
+
+#ifdef SWAPPY_ALLOC_CHECK
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/* Entry points of the glibc allocator, which the ones below wrap */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+/* Workers allocate as they please, each thread has its own count */
+static _Thread_local guint64 allocations;
+
+void *malloc(size_t size) {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  allocations++;
+  return __libc_realloc(ptr, size);
+}
+
+guint64 alloc_check_count(void) { return allocations; }
+
+void alloc_check_report(struct alloc_check *check, guint64 start) {
+  guint64 count = allocations - start;
+
+  check->events++;
+
+  if (count == 0) {
+    return;
+  }
+
+  check->allocating_events++;
+
+  g_warning("%s handler allocated %" PRIu64 " times, %" PRIu64 " of %" PRIu64
+            " events did",
+            check->name, count, check->allocating_events, check->events);
+}
+
+#endif
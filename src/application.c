@@ -1,18 +1,19 @@
 #include <gdk/gdk.h>
 #include <glib-2.0/glib.h>
-#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "alloc.h"
+#include "blur.h"
 #include "clipboard.h"
 #include "config.h"
-#include "file.h"
 #include "paint.h"
 #include "pixbuf.h"
 #include "render.h"
 #include "swappy.h"
+#include "view.h"
 
 static void update_ui_undo_redo(struct swappy_state *state) {
   GtkWidget *undo = GTK_WIDGET(state->ui->undo);
@@ -72,17 +73,23 @@ static void update_ui_transparent_toggle_button(struct swappy_state *state) {
 
 void application_finish(struct swappy_state *state) {
   g_debug("application finishing, cleaning up");
+  // Copies and saves are still being encoded when exiting early
+  clipboard_wait(state);
+  pixbuf_save_wait(state);
   paint_free_all(state);
   pixbuf_free(state);
+  // Freeing the paints cancelled their blurs, which still use the pool until
+  // they notice
+  blur_wait_tasks();
+  if (state->blur_pool) {
+    g_thread_pool_free(state->blur_pool, FALSE, TRUE);
+  }
   cairo_surface_destroy(state->rendering_surface);
+  cairo_surface_destroy(state->committed_surface);
+  cairo_surface_destroy(state->display_surface);
+  cairo_surface_destroy(state->brush_layer);
+  view_free(state);
   cairo_surface_destroy(state->original_image_surface);
-  if (state->temp_file_str) {
-    g_info("deleting temporary file: %s", state->temp_file_str);
-    if (g_unlink(state->temp_file_str) != 0) {
-      g_warning("unable to delete temporary file: %s", state->temp_file_str);
-    }
-    g_free(state->temp_file_str);
-  }
   g_free(state->file_str);
   g_free(state->geometry);
   g_free(state->window);
@@ -101,7 +108,11 @@ static void action_undo(struct swappy_state *state) {
     state->paints = g_list_remove_link(state->paints, first);
     state->redo_paints = g_list_prepend(state->redo_paints, first->data);
 
-    render_state(state);
+    // Redoing restarts any background work
+    paint_cancel_pending(first->data);
+
+    render_invalidate_committed_layer(state);
+    render_schedule(state);
     update_ui_undo_redo(state);
   }
 }
@@ -113,14 +124,15 @@ static void action_redo(struct swappy_state *state) {
     state->redo_paints = g_list_remove_link(state->redo_paints, first);
     state->paints = g_list_prepend(state->paints, first->data);
 
-    render_state(state);
+    render_schedule(state);
     update_ui_undo_redo(state);
   }
 }
 
 static void action_clear(struct swappy_state *state) {
   paint_free_all(state);
-  render_state(state);
+  render_invalidate_committed_layer(state);
+  render_schedule(state);
   update_ui_undo_redo(state);
 }
 
@@ -180,6 +192,11 @@ static void switch_mode_to_blur(struct swappy_state *state) {
   gtk_widget_set_sensitive(GTK_WIDGET(state->ui->fill_shape), false);
 }
 
+static void switch_mode_to_pixelate(struct swappy_state *state) {
+  state->mode = SWAPPY_PAINT_MODE_PIXELATE;
+  gtk_widget_set_sensitive(GTK_WIDGET(state->ui->fill_shape), false);
+}
+
 static void action_stroke_size_decrease(struct swappy_state *state) {
   guint step = state->settings.w <= 10 ? 1 : 5;
 
@@ -288,16 +305,16 @@ static void action_transparent_toggle(struct swappy_state *state,
 
 static void save_state_to_file_or_folder(struct swappy_state *state,
                                          char *file) {
-  GdkPixbuf *pixbuf = pixbuf_get_from_state(state);
+  struct swappy_export *export = pixbuf_export_get(state);
 
   if (file == NULL) {
-    pixbuf_save_state_to_folder(pixbuf, state->config->save_dir,
+    pixbuf_save_state_to_folder(state, export, state->config->save_dir,
                                 state->config->save_filename_format);
   } else {
-    pixbuf_save_to_file(pixbuf, file);
+    pixbuf_save_to_file(state, export, file);
   }
 
-  g_object_unref(pixbuf);
+  pixbuf_export_unref(export);
 
   if (state->config->early_exit) {
     gtk_main_quit();
@@ -323,13 +340,15 @@ static void screen_coordinates_to_image_coordinates(struct swappy_state *state,
                                                     gdouble *image_y) {
   gdouble x, y;
 
-  gint w = gdk_pixbuf_get_width(state->original_image);
-  gint h = gdk_pixbuf_get_height(state->original_image);
+  gint w = cairo_image_surface_get_width(state->original_image_surface);
+  gint h = cairo_image_surface_get_height(state->original_image_surface);
+
+  view_screen_to_image(state, screen_x, screen_y, &x, &y);
 
   // Clamp coordinates to original image properties to avoid side effects in
   // rendering pipeline
-  x = CLAMP(screen_x / state->scaling_factor, 0, w);
-  y = CLAMP(screen_y / state->scaling_factor, 0, h);
+  x = CLAMP(x, 0, w);
+  y = CLAMP(y, 0, h);
 
   *image_x = x;
   *image_y = y;
@@ -338,7 +357,7 @@ static void screen_coordinates_to_image_coordinates(struct swappy_state *state,
 static void commit_state(struct swappy_state *state) {
   paint_commit_temporary(state);
   paint_free_list(&state->redo_paints);
-  render_state(state);
+  render_schedule(state);
   update_ui_undo_redo(state);
 }
 
@@ -371,6 +390,10 @@ void blur_clicked_handler(GtkWidget *widget, struct swappy_state *state) {
   switch_mode_to_blur(state);
 }
 
+void pixelate_clicked_handler(GtkWidget *widget, struct swappy_state *state) {
+  switch_mode_to_pixelate(state);
+}
+
 void save_clicked_handler(GtkWidget *widget, struct swappy_state *state) {
   // Commit a potential paint (e.g. text being written)
   commit_state(state);
@@ -395,7 +418,7 @@ void control_modifier_changed(bool pressed, struct swappy_state *state) {
         paint_update_temporary_shape(
             state, state->temp_paint->content.shape.to.x,
             state->temp_paint->content.shape.to.y, pressed);
-        render_state(state);
+        render_schedule(state);
         break;
       default:
         break;
@@ -408,7 +431,7 @@ static void im_context_commit(GtkIMContext *imc, gchar *str,
   struct swappy_state *state = (struct swappy_state *)(user_data);
   if (state->temp_paint && state->mode == SWAPPY_PAINT_MODE_TEXT) {
     paint_update_temporary_str(state, str);
-    render_state(state);
+    render_schedule(state);
     return;
   }
 }
@@ -431,7 +454,7 @@ void window_keypress_handler(GtkWidget *widget, GdkEventKey *event,
     } else {
       paint_update_temporary_text(state, event);
     }
-    render_state(state);
+    render_schedule(state);
     return;
   }
   if (event->state & GDK_CONTROL_MASK) {
@@ -494,6 +517,11 @@ void window_keypress_handler(GtkWidget *widget, GdkEventKey *event,
         switch_mode_to_blur(state);
         gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(state->ui->blur), true);
         break;
+      case GDK_KEY_p:
+        switch_mode_to_pixelate(state);
+        gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(state->ui->pixelate),
+                                     true);
+        break;
       case GDK_KEY_x:
       case GDK_KEY_k:
         action_clear(state);
@@ -579,18 +607,9 @@ void redo_clicked_handler(GtkWidget *widget, struct swappy_state *state) {
 
 gboolean draw_area_handler(GtkWidget *widget, cairo_t *cr,
                            struct swappy_state *state) {
-  GtkAllocation *alloc = g_new(GtkAllocation, 1);
-  gtk_widget_get_allocation(widget, alloc);
-
-  GdkPixbuf *image = state->original_image;
-  gint image_width = gdk_pixbuf_get_width(image);
-  gint image_height = gdk_pixbuf_get_height(image);
-  double scale_x = (double)alloc->width / image_width;
-  double scale_y = (double)alloc->height / image_height;
-
-  cairo_scale(cr, scale_x, scale_y);
-  cairo_set_source_surface(cr, state->rendering_surface, 0, 0);
-  cairo_paint(cr);
+  ALLOC_CHECK_BEGIN("draw");
+  view_draw(state, cr);
+  ALLOC_CHECK_END();
 
   return FALSE;
 }
@@ -600,9 +619,15 @@ gboolean draw_area_configure_handler(GtkWidget *widget,
                                      struct swappy_state *state) {
   g_debug("received configure_event callback");
 
-  pixbuf_scale_surface_from_widget(state, widget);
+  // A new size only changes how the rendered image is scaled to the area, which
+  // is redrawn anyway. Rendering is needed when the surfaces are new.
+  if (pixbuf_scale_surface_from_widget(state, widget)) {
+    render_state(state);
+  }
 
-  render_state(state);
+  render_resize_display(state, gtk_widget_get_allocated_width(widget),
+                        gtk_widget_get_allocated_height(widget),
+                        gtk_widget_get_scale_factor(widget));
 
   return TRUE;
 }
@@ -611,18 +636,33 @@ void draw_area_button_press_handler(GtkWidget *widget, GdkEventButton *event,
                                     struct swappy_state *state) {
   gdouble x, y;
 
+  if (event->button == 2) {
+    state->view.panning = TRUE;
+    state->view.pan_x = event->x;
+    state->view.pan_y = event->y;
+    render_drag_begin(state);
+    return;
+  }
+
+  // Paints would be drawn over rows that are still being decoded
+  if (!pixbuf_is_loaded(state)) {
+    return;
+  }
+
   screen_coordinates_to_image_coordinates(state, event->x, event->y, &x, &y);
 
   if (event->button == 1) {
     switch (state->mode) {
       case SWAPPY_PAINT_MODE_BLUR:
+      case SWAPPY_PAINT_MODE_PIXELATE:
       case SWAPPY_PAINT_MODE_BRUSH:
       case SWAPPY_PAINT_MODE_RECTANGLE:
       case SWAPPY_PAINT_MODE_ELLIPSE:
       case SWAPPY_PAINT_MODE_ARROW:
       case SWAPPY_PAINT_MODE_TEXT:
         paint_add_temporary(state, x, y, state->mode);
-        render_state(state);
+        render_drag_begin(state);
+        render_schedule(state);
         update_ui_undo_redo(state);
         break;
       default:
@@ -630,50 +670,80 @@ void draw_area_button_press_handler(GtkWidget *widget, GdkEventButton *event,
     }
   }
 }
-void draw_area_motion_notify_handler(GtkWidget *widget, GdkEventMotion *event,
-                                     struct swappy_state *state) {
+/*
+ * Update the paint being drawn as the pointer moves, returns whether it
+ * changed.
+ */
+static gboolean update_paint_from_motion(struct swappy_state *state,
+                                         GdkEventMotion *event) {
   gdouble x, y;
-
-  screen_coordinates_to_image_coordinates(state, event->x, event->y, &x, &y);
-
-  GdkDisplay *display = gdk_display_get_default();
-  GdkWindow *window = event->window;
-  GdkCursor *crosshair = gdk_cursor_new_for_display(display, GDK_CROSSHAIR);
-  gdk_window_set_cursor(window, crosshair);
-
   gboolean is_button1_pressed = event->state & GDK_BUTTON1_MASK;
   gboolean is_control_pressed = event->state & GDK_CONTROL_MASK;
 
+  if (!is_button1_pressed) {
+    return FALSE;
+  }
+
+  screen_coordinates_to_image_coordinates(state, event->x, event->y, &x, &y);
+
   switch (state->mode) {
     case SWAPPY_PAINT_MODE_BLUR:
+    case SWAPPY_PAINT_MODE_PIXELATE:
     case SWAPPY_PAINT_MODE_BRUSH:
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
     case SWAPPY_PAINT_MODE_ARROW:
-      if (is_button1_pressed) {
-        paint_update_temporary_shape(state, x, y, is_control_pressed);
-        render_state(state);
-      }
-      break;
+      paint_update_temporary_shape(state, x, y, is_control_pressed);
+      return TRUE;
     case SWAPPY_PAINT_MODE_TEXT:
-      if (is_button1_pressed) {
-        paint_update_temporary_text_clip(state, x, y);
-        render_state(state);
-      }
-      break;
+      paint_update_temporary_text_clip(state, x, y);
+      return TRUE;
     default:
-      return;
+      return FALSE;
   }
-  g_object_unref(crosshair);
+}
+
+/*
+ * This runs for every motion event and must not allocate, which builds with
+ * -Dalloc-check=true report. While dragging, scheduling a render only sets a
+ * flag, see render_drag_begin().
+ */
+void draw_area_motion_notify_handler(GtkWidget *widget, GdkEventMotion *event,
+                                     struct swappy_state *state) {
+  ALLOC_CHECK_BEGIN("motion");
+
+  if (state->view.panning) {
+    view_pan(state, event->x - state->view.pan_x,
+             event->y - state->view.pan_y);
+    state->view.pan_x = event->x;
+    state->view.pan_y = event->y;
+  } else if (update_paint_from_motion(state, event)) {
+    render_schedule(state);
+  }
+
+  ALLOC_CHECK_END();
 }
 void draw_area_button_release_handler(GtkWidget *widget, GdkEventButton *event,
                                       struct swappy_state *state) {
+  if (event->button == 2) {
+    state->view.panning = FALSE;
+    if (!(event->state & GDK_BUTTON1_MASK)) {
+      render_drag_end(state);
+    }
+    return;
+  }
+
+  if (event->button == 1 && !state->view.panning) {
+    render_drag_end(state);
+  }
+
   if (!(event->state & GDK_BUTTON1_MASK)) {
     return;
   }
 
   switch (state->mode) {
     case SWAPPY_PAINT_MODE_BLUR:
+    case SWAPPY_PAINT_MODE_PIXELATE:
     case SWAPPY_PAINT_MODE_BRUSH:
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
@@ -691,6 +761,26 @@ void draw_area_button_release_handler(GtkWidget *widget, GdkEventButton *event,
   }
 }
 
+gboolean draw_area_scroll_handler(GtkWidget *widget, GdkEventScroll *event,
+                                  struct swappy_state *state) {
+  if (!(event->state & GDK_CONTROL_MASK)) {
+    return FALSE;
+  }
+
+  switch (event->direction) {
+    case GDK_SCROLL_UP:
+      view_zoom(state, 1, event->x, event->y);
+      break;
+    case GDK_SCROLL_DOWN:
+      view_zoom(state, -1, event->x, event->y);
+      break;
+    default:
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 void color_red_clicked_handler(GtkWidget *widget, struct swappy_state *state) {
   action_update_color_state(state, 1, 0, 0, 1, false);
 }
@@ -784,8 +874,9 @@ static void compute_window_size_and_scaling_factor(struct swappy_state *state) {
   double threshold = 0.75;
   double scaling_factor = 1.0;
 
-  int image_width = gdk_pixbuf_get_width(state->original_image);
-  int image_height = gdk_pixbuf_get_height(state->original_image);
+  cairo_surface_t *image = state->original_image_surface;
+  int image_width = cairo_image_surface_get_width(image);
+  int image_height = cairo_image_surface_get_height(image);
 
   int max_width = workarea.width * threshold;
   int max_height = workarea.height * threshold;
@@ -808,7 +899,6 @@ static void compute_window_size_and_scaling_factor(struct swappy_state *state) {
            scaling_factor);
   }
 
-  state->scaling_factor = scaling_factor;
   state->window->width = scaled_width;
   state->window->height = scaled_height;
 
@@ -888,6 +978,8 @@ static bool load_layout(struct swappy_state *state) {
       GTK_RADIO_BUTTON(gtk_builder_get_object(builder, "arrow"));
   GtkRadioButton *blur =
       GTK_RADIO_BUTTON(gtk_builder_get_object(builder, "blur"));
+  GtkRadioButton *pixelate =
+      GTK_RADIO_BUTTON(gtk_builder_get_object(builder, "pixelate"));
 
   state->ui->red =
       GTK_RADIO_BUTTON(gtk_builder_get_object(builder, "color-red-button"));
@@ -925,9 +1017,20 @@ static bool load_layout(struct swappy_state *state) {
   state->ui->ellipse = ellipse;
   state->ui->arrow = arrow;
   state->ui->blur = blur;
+  state->ui->pixelate = pixelate;
   state->ui->area = area;
   state->ui->window = window;
 
+  // Motion events are merged until the next frame, rendering happens then
+  gtk_widget_realize(area);
+  gdk_window_set_event_compression(gtk_widget_get_window(area), TRUE);
+
+  // Set once, the window keeps its own reference
+  GdkCursor *crosshair =
+      gdk_cursor_new_for_display(gtk_widget_get_display(area), GDK_CROSSHAIR);
+  gdk_window_set_cursor(gtk_widget_get_window(area), crosshair);
+  g_object_unref(crosshair);
+
   compute_window_size_and_scaling_factor(state);
   gtk_widget_set_size_request(area, state->window->width,
                               state->window->height);
@@ -965,13 +1068,18 @@ static void set_paint_mode(struct swappy_state *state) {
       gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(state->ui->blur), true);
       gtk_widget_set_sensitive(GTK_WIDGET(state->ui->fill_shape), false);
       break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(state->ui->pixelate),
+                                   true);
+      gtk_widget_set_sensitive(GTK_WIDGET(state->ui->fill_shape), false);
+      break;
     default:
       break;
   }
 }
 
 static bool init_gtk_window(struct swappy_state *state) {
-  if (!state->original_image) {
+  if (!state->original_image_surface) {
     g_critical("original image not loaded");
     return false;
   }
@@ -1001,10 +1109,6 @@ static gboolean has_option_file(struct swappy_state *state) {
   return (state->file_str != NULL);
 }
 
-static gboolean is_file_from_stdin(const char *file) {
-  return (strcmp(file, "-") == 0);
-}
-
 static void init_settings(struct swappy_state *state) {
   state->settings.r = 1;
   state->settings.g = 0;
@@ -1020,14 +1124,23 @@ static gint command_line_handler(GtkApplication *app,
                                  GApplicationCommandLine *cmdline,
                                  struct swappy_state *state) {
   config_load(state);
-  init_settings(state);
 
-  if (has_option_file(state)) {
-    if (is_file_from_stdin(state->file_str)) {
-      char *temp_file_str = file_dump_stdin_into_a_temp_file();
-      state->temp_file_str = temp_file_str;
+  if (state->png_compression != G_MININT) {
+    if (state->png_compression >= SWAPPY_PNG_COMPRESSION_MIN &&
+        state->png_compression <= SWAPPY_PNG_COMPRESSION_MAX) {
+      state->config->png_compression = state->png_compression;
+    } else {
+      g_warning("png-compression is not a valid value: %d - see man page for "
+                "details",
+                state->png_compression);
     }
+  }
+
+  init_settings(state);
 
+  state->blur_pool = blur_pool_new(state->config->blur_threads);
+
+  if (has_option_file(state)) {
     if (!pixbuf_init_from_file(state)) {
       return EXIT_FAILURE;
     }
@@ -1072,6 +1185,14 @@ bool application_init(struct swappy_state *state) {
           .description = "Print the final surface to the given file when "
                          "exiting, use - to print to stdout",
       },
+      {
+          .long_name = "png-compression",
+          .arg = G_OPTION_ARG_INT,
+          .arg_data = &state->png_compression,
+          .description = "Compression level of saved PNG files, from 0 "
+                         "(fastest) to 9 (smallest)",
+          .arg_description = "LEVEL",
+      },
       {
           .long_name = "version",
           .short_name = 'v',
@@ -1082,6 +1203,10 @@ bool application_init(struct swappy_state *state) {
       },
       {NULL}};  // NOLINT(clang-diagnostic-missing-field-initializers)
 
+  // Unset until parsed, the config file value is used then. Any value given
+  // on the command line, negative ones included, is checked.
+  state->png_compression = G_MININT;
+
   state->app = gtk_application_new("me.jtheoof.swappy",
                                    G_APPLICATION_HANDLES_COMMAND_LINE);
 
@@ -0,0 +1,1055 @@
+#include "blur.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "algebra.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLUR_HAVE_AVX2
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define BLUR_ROUND (1 << (GAUSSIAN_KERNEL_SHIFT - 1))
+
+/* Smallest amount of rows worth handing over to another thread */
+#define BLUR_BAND_MIN_HEIGHT 32
+
+/* Gaussian sigma for a kernel of radius 1, it scales with the radius */
+#define BLUR_SIGMA_PER_RADIUS (3.1 / 8)
+
+/* Box blur runs that many passes, enough to look like a gaussian */
+#define BLUR_BOX_PASSES 3
+
+/* Fixed point precision of the box blur reciprocal */
+#define BLUR_BOX_SHIFT 22
+#define BLUR_BOX_ROUND (1 << (BLUR_BOX_SHIFT - 1))
+
+/* Previews are blurred at this fraction of the surface resolution */
+#define BLUR_PREVIEW_FACTOR 4
+
+/*
+ * A span is a run of `count` consecutive ARGB32 pixels written to `dst`. Each
+ * pixel is the weighted sum of the source pixels found every `tap_stride`
+ * bytes around the pixel at the same offset in `src`: 4 for an horizontal
+ * pass, the surface stride for a vertical one.
+ *
+ * Spans do not check bounds, callers make sure every tap is within the
+ * surface. Channels are processed independently, which is fine since cairo
+ * stores them premultiplied.
+ */
+typedef void (*blur_span_func)(const uint8_t *src, ptrdiff_t tap_stride,
+                               uint8_t *dst, gint count,
+                               const struct gaussian_kernel *gaussian);
+
+static void blur_span_scalar(const uint8_t *src, ptrdiff_t tap_stride,
+                             uint8_t *dst, gint count,
+                             const struct gaussian_kernel *gaussian) {
+  for (gint p = 0; p < count; p++) {
+    const uint8_t *s = src + p * 4 - gaussian->radius * tap_stride;
+    guint32 u = BLUR_ROUND, v = BLUR_ROUND, w = BLUR_ROUND, z = BLUR_ROUND;
+
+    for (gint k = 0; k < gaussian->size; k++, s += tap_stride) {
+      guint32 weight = gaussian->kernel[k];
+      u += s[0] * weight;
+      v += s[1] * weight;
+      w += s[2] * weight;
+      z += s[3] * weight;
+    }
+
+    dst[p * 4 + 0] = u >> GAUSSIAN_KERNEL_SHIFT;
+    dst[p * 4 + 1] = v >> GAUSSIAN_KERNEL_SHIFT;
+    dst[p * 4 + 2] = w >> GAUSSIAN_KERNEL_SHIFT;
+    dst[p * 4 + 3] = z >> GAUSSIAN_KERNEL_SHIFT;
+  }
+}
+
+#if defined(__SSE2__)
+/*
+ * Blur 4 pixels per iteration. Channels are widened to 32 bits lanes, one
+ * register per pixel, and since weights fit in 16 bits `_mm_madd_epi16`
+ * multiplies them as (channel, 0) x (weight, 0) pairs.
+ */
+static void blur_span_sse2(const uint8_t *src, ptrdiff_t tap_stride,
+                           uint8_t *dst, gint count,
+                           const struct gaussian_kernel *gaussian) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(BLUR_ROUND);
+  gint p = 0;
+
+  for (; p + 4 <= count; p += 4) {
+    const uint8_t *s = src + p * 4 - gaussian->radius * tap_stride;
+    __m128i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+    for (gint k = 0; k < gaussian->size; k++, s += tap_stride) {
+      __m128i weight = _mm_set1_epi32(gaussian->kernel[k]);
+      __m128i pixels = _mm_loadu_si128((const __m128i *)s);
+      __m128i lo = _mm_unpacklo_epi8(pixels, zero);
+      __m128i hi = _mm_unpackhi_epi8(pixels, zero);
+
+      acc0 = _mm_add_epi32(
+          acc0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), weight));
+      acc1 = _mm_add_epi32(
+          acc1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), weight));
+      acc2 = _mm_add_epi32(
+          acc2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), weight));
+      acc3 = _mm_add_epi32(
+          acc3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), weight));
+    }
+
+    acc0 = _mm_srli_epi32(acc0, GAUSSIAN_KERNEL_SHIFT);
+    acc1 = _mm_srli_epi32(acc1, GAUSSIAN_KERNEL_SHIFT);
+    acc2 = _mm_srli_epi32(acc2, GAUSSIAN_KERNEL_SHIFT);
+    acc3 = _mm_srli_epi32(acc3, GAUSSIAN_KERNEL_SHIFT);
+
+    __m128i packed = _mm_packus_epi16(_mm_packs_epi32(acc0, acc1),
+                                      _mm_packs_epi32(acc2, acc3));
+    _mm_storeu_si128((__m128i *)(dst + p * 4), packed);
+  }
+
+  blur_span_scalar(src + p * 4, tap_stride, dst + p * 4, count - p, gaussian);
+}
+#endif
+
+#if defined(BLUR_HAVE_AVX2)
+/*
+ * Same as the SSE2 version with 8 pixels per iteration. Unpacking and packing
+ * both happen within 128 bits lanes so pixels come out in order.
+ */
+__attribute__((target("avx2"))) static void blur_span_avx2(
+    const uint8_t *src, ptrdiff_t tap_stride, uint8_t *dst, gint count,
+    const struct gaussian_kernel *gaussian) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(BLUR_ROUND);
+  gint p = 0;
+
+  for (; p + 8 <= count; p += 8) {
+    const uint8_t *s = src + p * 4 - gaussian->radius * tap_stride;
+    __m256i acc0 = round, acc1 = round, acc2 = round, acc3 = round;
+
+    for (gint k = 0; k < gaussian->size; k++, s += tap_stride) {
+      __m256i weight = _mm256_set1_epi32(gaussian->kernel[k]);
+      __m256i pixels = _mm256_loadu_si256((const __m256i *)s);
+      __m256i lo = _mm256_unpacklo_epi8(pixels, zero);
+      __m256i hi = _mm256_unpackhi_epi8(pixels, zero);
+
+      acc0 = _mm256_add_epi32(
+          acc0, _mm256_madd_epi16(_mm256_unpacklo_epi16(lo, zero), weight));
+      acc1 = _mm256_add_epi32(
+          acc1, _mm256_madd_epi16(_mm256_unpackhi_epi16(lo, zero), weight));
+      acc2 = _mm256_add_epi32(
+          acc2, _mm256_madd_epi16(_mm256_unpacklo_epi16(hi, zero), weight));
+      acc3 = _mm256_add_epi32(
+          acc3, _mm256_madd_epi16(_mm256_unpackhi_epi16(hi, zero), weight));
+    }
+
+    acc0 = _mm256_srli_epi32(acc0, GAUSSIAN_KERNEL_SHIFT);
+    acc1 = _mm256_srli_epi32(acc1, GAUSSIAN_KERNEL_SHIFT);
+    acc2 = _mm256_srli_epi32(acc2, GAUSSIAN_KERNEL_SHIFT);
+    acc3 = _mm256_srli_epi32(acc3, GAUSSIAN_KERNEL_SHIFT);
+
+    __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(acc0, acc1),
+                                         _mm256_packs_epi32(acc2, acc3));
+    _mm256_storeu_si256((__m256i *)(dst + p * 4), packed);
+  }
+
+  blur_span_scalar(src + p * 4, tap_stride, dst + p * 4, count - p, gaussian);
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void blur_span_neon(const uint8_t *src, ptrdiff_t tap_stride,
+                           uint8_t *dst, gint count,
+                           const struct gaussian_kernel *gaussian) {
+  gint p = 0;
+
+  for (; p + 4 <= count; p += 4) {
+    const uint8_t *s = src + p * 4 - gaussian->radius * tap_stride;
+    uint32x4_t acc0 = vdupq_n_u32(BLUR_ROUND);
+    uint32x4_t acc1 = acc0, acc2 = acc0, acc3 = acc0;
+
+    for (gint k = 0; k < gaussian->size; k++, s += tap_stride) {
+      uint16_t weight = (uint16_t)gaussian->kernel[k];
+      uint8x16_t pixels = vld1q_u8(s);
+      uint16x8_t lo = vmovl_u8(vget_low_u8(pixels));
+      uint16x8_t hi = vmovl_u8(vget_high_u8(pixels));
+
+      acc0 = vmlal_n_u16(acc0, vget_low_u16(lo), weight);
+      acc1 = vmlal_n_u16(acc1, vget_high_u16(lo), weight);
+      acc2 = vmlal_n_u16(acc2, vget_low_u16(hi), weight);
+      acc3 = vmlal_n_u16(acc3, vget_high_u16(hi), weight);
+    }
+
+    uint16x8_t p01 = vcombine_u16(vshrn_n_u32(acc0, GAUSSIAN_KERNEL_SHIFT),
+                                  vshrn_n_u32(acc1, GAUSSIAN_KERNEL_SHIFT));
+    uint16x8_t p23 = vcombine_u16(vshrn_n_u32(acc2, GAUSSIAN_KERNEL_SHIFT),
+                                  vshrn_n_u32(acc3, GAUSSIAN_KERNEL_SHIFT));
+    vst1q_u8(dst + p * 4, vcombine_u8(vqmovn_u16(p01), vqmovn_u16(p23)));
+  }
+
+  blur_span_scalar(src + p * 4, tap_stride, dst + p * 4, count - p, gaussian);
+}
+#endif
+
+static blur_span_func get_blur_span_func(void) {
+#if defined(BLUR_HAVE_AVX2)
+  if (__builtin_cpu_supports("avx2")) {
+    return blur_span_avx2;
+  }
+#endif
+#if defined(__SSE2__)
+  return blur_span_sse2;
+#elif defined(__ARM_NEON)
+  return blur_span_neon;
+#else
+  return blur_span_scalar;
+#endif
+}
+
+/*
+ * Blur a single pixel whose taps may fall outside of the line of `length`
+ * pixels, those are clamped to the closest edge.
+ */
+static void blur_pixel_clamped(const uint8_t *line, ptrdiff_t tap_stride,
+                               gint pos, gint length, uint8_t *dst,
+                               const struct gaussian_kernel *gaussian) {
+  guint32 u = BLUR_ROUND, v = BLUR_ROUND, w = BLUR_ROUND, z = BLUR_ROUND;
+
+  for (gint k = 0; k < gaussian->size; k++) {
+    gint i = CLAMP(pos - gaussian->radius + k, 0, length - 1);
+    const uint8_t *s = line + i * tap_stride;
+    guint32 weight = gaussian->kernel[k];
+    u += s[0] * weight;
+    v += s[1] * weight;
+    w += s[2] * weight;
+    z += s[3] * weight;
+  }
+
+  dst[0] = u >> GAUSSIAN_KERNEL_SHIFT;
+  dst[1] = v >> GAUSSIAN_KERNEL_SHIFT;
+  dst[2] = w >> GAUSSIAN_KERNEL_SHIFT;
+  dst[3] = z >> GAUSSIAN_KERNEL_SHIFT;
+}
+
+static void blur_horizontal(const uint8_t *src, uint8_t *dst, gint stride,
+                            gint width, gint x1, gint y1, gint x2, gint y2,
+                            blur_span_func blur_span,
+                            const struct gaussian_kernel *gaussian) {
+  // Columns whose taps are all within the surface
+  gint inner_x1 = CLAMP(gaussian->radius, x1, x2);
+  gint inner_x2 = CLAMP(width - gaussian->radius, inner_x1, x2);
+
+  for (gint i = y1; i < y2; i++) {
+    const uint8_t *s = src + (ptrdiff_t)i * stride;
+    uint8_t *d = dst + (ptrdiff_t)i * stride;
+
+    for (gint j = x1; j < inner_x1; j++) {
+      blur_pixel_clamped(s, 4, j, width, d + j * 4, gaussian);
+    }
+
+    blur_span(s + inner_x1 * 4, 4, d + inner_x1 * 4, inner_x2 - inner_x1,
+              gaussian);
+
+    for (gint j = inner_x2; j < x2; j++) {
+      blur_pixel_clamped(s, 4, j, width, d + j * 4, gaussian);
+    }
+  }
+}
+
+static void blur_vertical(const uint8_t *src, uint8_t *dst, gint stride,
+                          gint height, gint x1, gint y1, gint x2, gint y2,
+                          blur_span_func blur_span,
+                          const struct gaussian_kernel *gaussian) {
+  for (gint i = y1; i < y2; i++) {
+    const uint8_t *s = src + (ptrdiff_t)i * stride;
+    uint8_t *d = dst + (ptrdiff_t)i * stride;
+
+    if (i - gaussian->radius >= 0 && i + gaussian->radius < height) {
+      blur_span(s + x1 * 4, stride, d + x1 * 4, x2 - x1, gaussian);
+    } else {
+      for (gint j = x1; j < x2; j++) {
+        blur_pixel_clamped(src + j * 4, stride, i, height, d + j * 4,
+                           gaussian);
+      }
+    }
+  }
+}
+
+/*
+ * Box blur of a band of rows, each output pixel is the average of the
+ * 2 * radius + 1 pixels around it. A running sum is updated by adding the pixel
+ * entering the window and removing the one leaving it, so the cost does not
+ * depend on the radius. Edges are clamped like the gaussian ones.
+ */
+static void blur_box_horizontal(const uint8_t *src, uint8_t *dst, gint stride,
+                                gint width, gint y1, gint y2, gint radius) {
+  guint32 mul = ((1u << BLUR_BOX_SHIFT) + radius) / (2 * radius + 1);
+
+  for (gint i = y1; i < y2; i++) {
+    const uint8_t *s = src + (ptrdiff_t)i * stride;
+    uint8_t *d = dst + (ptrdiff_t)i * stride;
+    gint32 sum[4];
+
+    for (gint c = 0; c < 4; c++) {
+      sum[c] = (radius + 1) * s[c];
+      for (gint k = 1; k <= radius; k++) {
+        sum[c] += s[MIN(k, width - 1) * 4 + c];
+      }
+    }
+
+    for (gint j = 0; j < width; j++) {
+      const uint8_t *in = s + MIN(j + radius + 1, width - 1) * 4;
+      const uint8_t *out = s + MAX(j - radius, 0) * 4;
+
+      for (gint c = 0; c < 4; c++) {
+        d[j * 4 + c] =
+            ((guint32)sum[c] * mul + BLUR_BOX_ROUND) >> BLUR_BOX_SHIFT;
+        sum[c] += in[c] - out[c];
+      }
+    }
+  }
+}
+
+/*
+ * Vertical counterpart of blur_box_horizontal(). Rows are walked in order with
+ * one running sum per byte of the row, which keeps memory accesses sequential.
+ */
+static void blur_box_vertical(const uint8_t *src, uint8_t *dst, gint stride,
+                              gint width, gint height, gint y1, gint y2,
+                              gint radius) {
+  guint32 mul = ((1u << BLUR_BOX_SHIFT) + radius) / (2 * radius + 1);
+  gint row_size = width * 4;
+  gint32 *sum = g_new0(gint32, row_size);
+
+  for (gint k = y1 - radius; k <= y1 + radius; k++) {
+    const uint8_t *s = src + (ptrdiff_t)CLAMP(k, 0, height - 1) * stride;
+    for (gint j = 0; j < row_size; j++) {
+      sum[j] += s[j];
+    }
+  }
+
+  for (gint i = y1; i < y2; i++) {
+    const uint8_t *in =
+        src + (ptrdiff_t)MIN(i + radius + 1, height - 1) * stride;
+    const uint8_t *out = src + (ptrdiff_t)MAX(i - radius, 0) * stride;
+    uint8_t *d = dst + (ptrdiff_t)i * stride;
+
+    for (gint j = 0; j < row_size; j++) {
+      d[j] = ((guint32)sum[j] * mul + BLUR_BOX_ROUND) >> BLUR_BOX_SHIFT;
+      sum[j] += in[j] - out[j];
+    }
+  }
+
+  g_free(sum);
+}
+
+/*
+ * Everything needed to run the passes of a blur, in device pixels. The apron
+ * is how far passes read around the blurred area.
+ */
+struct blur_kernel {
+  enum swappy_blur_algorithm algorithm;
+  guint nb_passes;
+  gint apron;
+  struct gaussian_kernel *gaussian;
+  blur_span_func blur_span;
+  gint box_radius[BLUR_BOX_PASSES];
+};
+
+/*
+ * Box sizes whose successive passes approximate a gaussian of `sigma`, see
+ * "Fastest Gaussian Blur (in linear time)" by Ivan Kutskir.
+ */
+static void get_box_radius(double sigma, gint *box_radius) {
+  gint n = BLUR_BOX_PASSES;
+  double ideal = sqrt(12 * sigma * sigma / n + 1);
+  gint lower = (gint)floor(ideal);
+
+  if (lower % 2 == 0) {
+    lower--;
+  }
+
+  gint upper = lower + 2;
+  gint m = (gint)round((12 * sigma * sigma - n * lower * lower -
+                        4 * n * lower - 3 * n) /
+                       (-4 * lower - 4));
+
+  for (gint i = 0; i < n; i++) {
+    box_radius[i] = ((i < m ? lower : upper) - 1) / 2;
+  }
+}
+
+static void blur_kernel_init(struct blur_kernel *kernel,
+                             enum swappy_blur_algorithm algorithm,
+                             double radius, double scale_x, double scale_y) {
+  // Gaussian passes grow with the scale, the box blur matches their result
+  guint nb_gaussian_passes = (guint)sqrt(scale_x * scale_y) + 1;
+  double sigma = radius * BLUR_SIGMA_PER_RADIUS;
+
+  kernel->algorithm = algorithm;
+  kernel->gaussian = NULL;
+  kernel->blur_span = NULL;
+
+  switch (algorithm) {
+    case SWAPPY_BLUR_ALGORITHM_BOX:
+      kernel->nb_passes = BLUR_BOX_PASSES;
+      kernel->apron = 0;
+      get_box_radius(sigma * sqrt(nb_gaussian_passes), kernel->box_radius);
+      for (gint i = 0; i < BLUR_BOX_PASSES; i++) {
+        kernel->apron += kernel->box_radius[i];
+      }
+      break;
+    case SWAPPY_BLUR_ALGORITHM_GAUSSIAN:
+    default:
+      kernel->algorithm = SWAPPY_BLUR_ALGORITHM_GAUSSIAN;
+      kernel->nb_passes = nb_gaussian_passes;
+      kernel->gaussian = gaussian_kernel(MAX((gint)round(radius), 1), sigma);
+      kernel->blur_span = get_blur_span_func();
+      kernel->apron = kernel->gaussian->radius * kernel->nb_passes;
+      break;
+  }
+}
+
+static void blur_kernel_clear(struct blur_kernel *kernel) {
+  if (kernel->gaussian) {
+    gaussian_kernel_free(kernel->gaussian);
+    kernel->gaussian = NULL;
+  }
+}
+
+struct blur_barrier {
+  GMutex mutex;
+  GCond cond;
+  gint pending;
+};
+
+struct blur_band {
+  const uint8_t *src;
+  uint8_t *dst;
+  gint stride;
+  gint width;
+  gint height;
+  gint y1;
+  gint y2;
+  gboolean vertical;
+  const struct blur_kernel *kernel;
+  guint pass;
+  struct blur_barrier *barrier;
+};
+
+static void blur_band_run(struct blur_band *band) {
+  const struct blur_kernel *kernel = band->kernel;
+
+  switch (kernel->algorithm) {
+    case SWAPPY_BLUR_ALGORITHM_BOX:
+      if (band->vertical) {
+        blur_box_vertical(band->src, band->dst, band->stride, band->width,
+                          band->height, band->y1, band->y2,
+                          kernel->box_radius[band->pass]);
+      } else {
+        blur_box_horizontal(band->src, band->dst, band->stride, band->width,
+                            band->y1, band->y2,
+                            kernel->box_radius[band->pass]);
+      }
+      break;
+    case SWAPPY_BLUR_ALGORITHM_GAUSSIAN:
+    default:
+      if (band->vertical) {
+        blur_vertical(band->src, band->dst, band->stride, band->height, 0,
+                      band->y1, band->width, band->y2, kernel->blur_span,
+                      kernel->gaussian);
+      } else {
+        blur_horizontal(band->src, band->dst, band->stride, band->width, 0,
+                        band->y1, band->width, band->y2, kernel->blur_span,
+                        kernel->gaussian);
+      }
+      break;
+  }
+}
+
+static void blur_band_done(struct blur_band *band) {
+  struct blur_barrier *barrier = band->barrier;
+
+  g_mutex_lock(&barrier->mutex);
+  if (--barrier->pending == 0) {
+    g_cond_signal(&barrier->cond);
+  }
+  g_mutex_unlock(&barrier->mutex);
+}
+
+static void blur_band_worker(gpointer data, gpointer user_data) {
+  struct blur_band *band = data;
+
+  blur_band_run(band);
+  blur_band_done(band);
+}
+
+/*
+ * Run one pass over all the rows of the buffer. Rows are split in bands, the
+ * calling thread takes care of the first one while the pool works on the
+ * others. Returns once every band is done since the next pass reads them.
+ */
+static void blur_pass(GThreadPool *pool, const uint8_t *src, uint8_t *dst,
+                      gint stride, gint width, gint height, gboolean vertical,
+                      const struct blur_kernel *kernel, guint pass) {
+  struct blur_band bands[SWAPPY_BLUR_THREADS_MAX];
+  struct blur_barrier barrier;
+  gint nb_bands = 1;
+
+  if (pool) {
+    nb_bands = MIN(g_thread_pool_get_max_threads(pool) + 1,
+                   height / BLUR_BAND_MIN_HEIGHT);
+    nb_bands = CLAMP(nb_bands, 1, SWAPPY_BLUR_THREADS_MAX);
+  }
+
+  g_mutex_init(&barrier.mutex);
+  g_cond_init(&barrier.cond);
+  barrier.pending = nb_bands;
+
+  for (gint b = 0; b < nb_bands; b++) {
+    struct blur_band *band = &bands[b];
+    band->src = src;
+    band->dst = dst;
+    band->stride = stride;
+    band->width = width;
+    band->height = height;
+    band->y1 = height * b / nb_bands;
+    band->y2 = height * (b + 1) / nb_bands;
+    band->vertical = vertical;
+    band->kernel = kernel;
+    band->pass = pass;
+    band->barrier = &barrier;
+
+    if (b > 0 && g_thread_pool_push(pool, band, NULL)) {
+      continue;
+    }
+
+    blur_band_run(band);
+    blur_band_done(band);
+  }
+
+  g_mutex_lock(&barrier.mutex);
+  while (barrier.pending > 0) {
+    g_cond_wait(&barrier.cond, &barrier.mutex);
+  }
+  g_mutex_unlock(&barrier.mutex);
+
+  g_mutex_clear(&barrier.mutex);
+  g_cond_clear(&barrier.cond);
+}
+
+GThreadPool *blur_pool_new(guint nb_threads) {
+  GThreadPool *pool;
+  GError *error = NULL;
+
+  if (nb_threads == 0) {
+    nb_threads = g_get_num_processors();
+  }
+
+  nb_threads = MIN(nb_threads, SWAPPY_BLUR_THREADS_MAX);
+
+  // The thread calling blur_surface blurs a band as well
+  if (nb_threads <= 1) {
+    return NULL;
+  }
+
+  pool = g_thread_pool_new(blur_band_worker, NULL, nb_threads - 1, FALSE,
+                           &error);
+
+  if (error != NULL) {
+    g_warning("unable to create blur thread pool: %s", error->message);
+    g_error_free(error);
+    return NULL;
+  }
+
+  g_info("blurring with up to %u threads", nb_threads);
+
+  return pool;
+}
+
+/*
+ * Device pixels of `surface` covered by the (x, y, width, height) user space
+ * rectangle, and the apron around it the blur passes read from. Both are
+ * clamped to the surface.
+ */
+struct blur_area {
+  int start_x, start_y;
+  int end_x, end_y;
+  int apron_x, apron_y;
+  int apron_width, apron_height;
+};
+
+static void get_blur_area(cairo_surface_t *surface, double x, double y,
+                          double width, double height, int apron,
+                          struct blur_area *area) {
+  gdouble scale_x, scale_y;
+  int src_width = cairo_image_surface_get_width(surface);
+  int src_height = cairo_image_surface_get_height(surface);
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  area->start_x = CLAMP(x * scale_x, 0, src_width);
+  area->start_y = CLAMP(y * scale_y, 0, src_height);
+
+  area->end_x = CLAMP((x + width) * scale_x, 0, src_width);
+  area->end_y = CLAMP((y + height) * scale_y, 0, src_height);
+
+  area->apron_x = MAX(area->start_x - apron, 0);
+  area->apron_y = MAX(area->start_y - apron, 0);
+  area->apron_width = MIN(area->end_x + apron, src_width) - area->apron_x;
+  area->apron_height = MIN(area->end_y + apron, src_height) - area->apron_y;
+}
+
+/*
+ * This code was originally taken from Kristian Høgsberg and Chris Wilson from:
+ * https://www.cairographics.org/cookbook/blur.c/
+ *
+ * Only the blurred area and the apron of the kernel around it are copied out
+ * of the surface, that is all the passes ever read.
+ *
+ * Returns NULL if `cancellable` is cancelled before the last pass.
+ */
+static cairo_surface_t *blur_surface_cancellable(
+    cairo_surface_t *surface, double x, double y, double width, double height,
+    enum swappy_blur_algorithm algorithm, double radius, GThreadPool *pool,
+    GCancellable *cancellable) {
+  cairo_surface_t *final = NULL;
+  int src_stride;
+  int stride, final_stride;
+  uint8_t *src, *dst, *tmp, *final_data;
+  struct blur_kernel kernel;
+  struct blur_area area;
+  gdouble scale_x, scale_y;
+  guint pass;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  cairo_format_t src_format = cairo_image_surface_get_format(surface);
+  switch (src_format) {
+    case CAIRO_FORMAT_A1:
+    case CAIRO_FORMAT_A8:
+    default:
+      g_warning("source surface format: %d is not supported", src_format);
+      return NULL;
+    case CAIRO_FORMAT_RGB24:
+    case CAIRO_FORMAT_ARGB32:
+      break;
+  }
+
+  src_stride = cairo_image_surface_get_stride(surface);
+
+  blur_kernel_init(&kernel, algorithm, radius, scale_x, scale_y);
+  get_blur_area(surface, x, y, width, height, kernel.apron, &area);
+
+  int start_x = area.start_x;
+  int start_y = area.start_y;
+  int end_x = area.end_x;
+  int end_y = area.end_y;
+  int apron_x = area.apron_x;
+  int apron_y = area.apron_y;
+  int apron_width = area.apron_width;
+  int apron_height = area.apron_height;
+
+  final = cairo_image_surface_create(src_format, end_x - start_x,
+                                     end_y - start_y);
+
+  if (cairo_surface_status(final)) {
+    cairo_surface_destroy(final);
+    blur_kernel_clear(&kernel);
+    return NULL;
+  }
+
+  cairo_surface_set_device_scale(final, scale_x, scale_y);
+
+  if (end_x <= start_x || end_y <= start_y) {
+    blur_kernel_clear(&kernel);
+    return final;
+  }
+
+  stride = apron_width * 4;
+  dst = g_new(uint8_t, (gsize)stride * apron_height);
+  tmp = g_new(uint8_t, (gsize)stride * apron_height);
+
+  cairo_surface_flush(surface);
+  src = cairo_image_surface_get_data(surface);
+
+  for (int i = 0; i < apron_height; i++) {
+    memcpy(dst + (ptrdiff_t)i * stride,
+           src + (ptrdiff_t)(apron_y + i) * src_stride + apron_x * 4, stride);
+  }
+
+  for (pass = 0; pass < kernel.nb_passes; pass++) {
+    if (g_cancellable_is_cancelled(cancellable)) {
+      cairo_surface_destroy(final);
+      final = NULL;
+      goto finish;
+    }
+
+    /* Horizontally blur from dst -> tmp */
+    blur_pass(pool, dst, tmp, stride, apron_width, apron_height, FALSE,
+              &kernel, pass);
+
+    /* Then vertically blur from tmp -> dst */
+    blur_pass(pool, tmp, dst, stride, apron_width, apron_height, TRUE,
+              &kernel, pass);
+  }
+
+  final_data = cairo_image_surface_get_data(final);
+  final_stride = cairo_image_surface_get_stride(final);
+
+  for (int i = 0; i < end_y - start_y; i++) {
+    memcpy(final_data + (ptrdiff_t)i * final_stride,
+           dst + (ptrdiff_t)(start_y - apron_y + i) * stride +
+               (start_x - apron_x) * 4,
+           (end_x - start_x) * 4);
+  }
+
+  // Mark final surface as dirty since it was altered with custom data.
+  cairo_surface_mark_dirty(final);
+
+finish:
+  g_free(dst);
+  g_free(tmp);
+  blur_kernel_clear(&kernel);
+
+  return final;
+}
+
+cairo_surface_t *blur_surface(cairo_surface_t *surface, double x, double y,
+                              double width, double height,
+                              enum swappy_blur_algorithm algorithm,
+                              guint radius, GThreadPool *pool) {
+  return blur_surface_cancellable(surface, x, y, width, height, algorithm,
+                                  radius, pool, NULL);
+}
+
+/*
+ * Cheap approximation of blur_surface() over `area`: the area and the apron
+ * around it are downscaled by BLUR_PREVIEW_FACTOR and blurred with a kernel
+ * shrunk by the same factor. The result has a device scale and offset placing
+ * it over `area` in the user space of `surface`, it can be painted in place of
+ * the original at (0, 0). It runs on the calling thread: bands pushed to the
+ * pool would queue behind those of the background blurs.
+ */
+cairo_surface_t *blur_surface_preview(cairo_surface_t *surface,
+                                      struct swappy_box *area,
+                                      enum swappy_blur_algorithm algorithm,
+                                      guint radius) {
+  cairo_surface_t *small, *blurred;
+  struct blur_kernel kernel;
+  cairo_t *cr;
+  gdouble scale_x, scale_y;
+  int apron;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  blur_kernel_init(&kernel, algorithm, radius, scale_x, scale_y);
+  apron = kernel.apron;
+  blur_kernel_clear(&kernel);
+
+  // Device pixels of the area and its apron, clamped to the surface
+  int src_width = cairo_image_surface_get_width(surface);
+  int src_height = cairo_image_surface_get_height(surface);
+  int x1 = CLAMP(floor(area->x * scale_x) - apron, 0, src_width);
+  int y1 = CLAMP(floor(area->y * scale_y) - apron, 0, src_height);
+  int x2 = CLAMP(ceil((area->x + area->width) * scale_x) + apron, 0, src_width);
+  int y2 =
+      CLAMP(ceil((area->y + area->height) * scale_y) + apron, 0, src_height);
+
+  if (x2 <= x1 || y2 <= y1) {
+    return NULL;
+  }
+
+  int width = MAX((x2 - x1) / BLUR_PREVIEW_FACTOR, 1);
+  int height = MAX((y2 - y1) / BLUR_PREVIEW_FACTOR, 1);
+  double factor_x = (double)width / (x2 - x1);
+  double factor_y = (double)height / (y2 - y1);
+
+  small = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+
+  if (cairo_surface_status(small)) {
+    cairo_surface_destroy(small);
+    return NULL;
+  }
+
+  cr = cairo_create(small);
+  cairo_scale(cr, factor_x * scale_x, factor_y * scale_y);
+  cairo_translate(cr, -x1 / scale_x, -y1 / scale_y);
+  cairo_set_source_surface(cr, surface, 0, 0);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+
+  blurred = blur_surface_cancellable(small, 0, 0, width, height, algorithm,
+                                     (double)radius / BLUR_PREVIEW_FACTOR, NULL,
+                                     NULL);
+  cairo_surface_destroy(small);
+
+  if (blurred) {
+    cairo_surface_set_device_scale(blurred, factor_x * scale_x,
+                                   factor_y * scale_y);
+    cairo_surface_set_device_offset(blurred, -x1 * factor_x, -y1 * factor_y);
+  }
+
+  return blurred;
+}
+
+/*
+ * A blur computed on a worker thread. Its result is kept here as well, so that
+ * blur_job_wait() can take it without waiting for the callback to be invoked.
+ */
+struct blur_job {
+  gint ref_count;
+  cairo_surface_t *snapshot;
+  double x;
+  double y;
+  double width;
+  double height;
+  enum swappy_blur_algorithm algorithm;
+  guint radius;
+  GThreadPool *pool;
+  /* Both protected by blur_tasks.mutex */
+  gboolean done;
+  cairo_surface_t *blurred;
+};
+
+void blur_job_unref(struct blur_job *job) {
+  if (!g_atomic_int_dec_and_test(&job->ref_count)) {
+    return;
+  }
+
+  cairo_surface_destroy(job->snapshot);
+  if (job->blurred) {
+    cairo_surface_destroy(job->blurred);
+  }
+  g_free(job);
+}
+
+/*
+ * Copy the area blurring (x, y, width, height) reads from `surface` into a new
+ * surface, so that it can be blurred on another thread while the original
+ * keeps being drawn on. `x` and `y` are updated to the snapshot coordinates.
+ */
+static cairo_surface_t *blur_snapshot(cairo_surface_t *surface, double *x,
+                                      double *y, double width, double height,
+                                      enum swappy_blur_algorithm algorithm,
+                                      guint radius) {
+  cairo_surface_t *snapshot;
+  struct blur_kernel kernel;
+  struct blur_area area;
+  gdouble scale_x, scale_y;
+  uint8_t *src, *dst;
+  int src_stride, dst_stride;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  if (format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32) {
+    g_warning("source surface format: %d is not supported", format);
+    return NULL;
+  }
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  blur_kernel_init(&kernel, algorithm, radius, scale_x, scale_y);
+  get_blur_area(surface, *x, *y, width, height, kernel.apron, &area);
+  blur_kernel_clear(&kernel);
+
+  snapshot = cairo_image_surface_create(format, MAX(area.apron_width, 1),
+                                        MAX(area.apron_height, 1));
+
+  if (cairo_surface_status(snapshot)) {
+    cairo_surface_destroy(snapshot);
+    return NULL;
+  }
+
+  cairo_surface_set_device_scale(snapshot, scale_x, scale_y);
+
+  cairo_surface_flush(surface);
+  src = cairo_image_surface_get_data(surface);
+  src_stride = cairo_image_surface_get_stride(surface);
+  dst = cairo_image_surface_get_data(snapshot);
+  dst_stride = cairo_image_surface_get_stride(snapshot);
+
+  for (int i = 0; i < area.apron_height; i++) {
+    memcpy(dst + (ptrdiff_t)i * dst_stride,
+           src + (ptrdiff_t)(area.apron_y + i) * src_stride + area.apron_x * 4,
+           (size_t)area.apron_width * 4);
+  }
+
+  cairo_surface_mark_dirty(snapshot);
+
+  *x -= area.apron_x / scale_x;
+  *y -= area.apron_y / scale_y;
+
+  return snapshot;
+}
+
+/*
+ * Background blurs push bands to the pool they were given, which must outlive
+ * them. They are counted so that blur_wait_tasks() can tell when they are all
+ * done. Statically allocated mutexes and conds need no initialization.
+ */
+static struct {
+  GMutex mutex;
+  GCond cond;
+  guint running;
+} blur_tasks;
+
+static void blur_task_run(GTask *task, struct blur_job *job,
+                          GCancellable *cancellable) {
+  cairo_surface_t *blurred;
+
+  blurred = blur_surface_cancellable(job->snapshot, job->x, job->y, job->width,
+                                     job->height, job->algorithm, job->radius,
+                                     job->pool, cancellable);
+
+  if (g_task_return_error_if_cancelled(task)) {
+    if (blurred) {
+      cairo_surface_destroy(blurred);
+    }
+    return;
+  }
+
+  if (!blurred) {
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "unable to blur surface");
+    return;
+  }
+
+  g_mutex_lock(&blur_tasks.mutex);
+  job->blurred = cairo_surface_reference(blurred);
+  g_mutex_unlock(&blur_tasks.mutex);
+
+  g_task_return_pointer(task, blurred, (GDestroyNotify)cairo_surface_destroy);
+}
+
+static void blur_task_thread(GTask *task, gpointer source_object,
+                             gpointer task_data, GCancellable *cancellable) {
+  struct blur_job *job = task_data;
+
+  blur_task_run(task, job, cancellable);
+
+  g_mutex_lock(&blur_tasks.mutex);
+  job->done = TRUE;
+  blur_tasks.running--;
+  g_cond_broadcast(&blur_tasks.cond);
+  g_mutex_unlock(&blur_tasks.mutex);
+}
+
+/*
+ * Asynchronous version of blur_surface(). The pixels it needs are copied out
+ * of `surface` before returning, the blur itself runs on a worker thread and
+ * `callback` is invoked from the main context once it is done. The job
+ * returned is for blur_job_wait(), NULL when the blur could not be started.
+ */
+struct blur_job *blur_surface_async(cairo_surface_t *surface, double x,
+                                    double y, double width, double height,
+                                    enum swappy_blur_algorithm algorithm,
+                                    guint radius, GThreadPool *pool,
+                                    GCancellable *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer user_data) {
+  GTask *task = g_task_new(NULL, cancellable, callback, user_data);
+  cairo_surface_t *snapshot =
+      blur_snapshot(surface, &x, &y, width, height, algorithm, radius);
+
+  if (!snapshot) {
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "unable to copy surface to blur");
+    g_object_unref(task);
+    return NULL;
+  }
+
+  struct blur_job *job = g_new0(struct blur_job, 1);
+  job->ref_count = 2;
+  job->snapshot = snapshot;
+  job->x = x;
+  job->y = y;
+  job->width = width;
+  job->height = height;
+  job->algorithm = algorithm;
+  job->radius = radius;
+  job->pool = pool;
+
+  g_mutex_lock(&blur_tasks.mutex);
+  blur_tasks.running++;
+  g_mutex_unlock(&blur_tasks.mutex);
+
+  g_task_set_task_data(task, job, (GDestroyNotify)blur_job_unref);
+  g_task_run_in_thread(task, blur_task_thread);
+  g_object_unref(task);
+
+  return job;
+}
+
+cairo_surface_t *blur_surface_finish(GAsyncResult *result, GError **error) {
+  return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/*
+ * Block until the worker is done with `job` and take its result, NULL if it
+ * failed or was cancelled. The callback is still invoked afterwards, cancel
+ * the job for it to get G_IO_ERROR_CANCELLED instead of the result.
+ */
+cairo_surface_t *blur_job_wait(struct blur_job *job) {
+  cairo_surface_t *blurred;
+
+  g_mutex_lock(&blur_tasks.mutex);
+  while (!job->done) {
+    g_cond_wait(&blur_tasks.cond, &blur_tasks.mutex);
+  }
+  blurred = job->blurred;
+  job->blurred = NULL;
+  g_mutex_unlock(&blur_tasks.mutex);
+
+  return blurred;
+}
+
+/*
+ * How far blurring reads around the blurred area, in the coordinates of
+ * `surface`.
+ */
+double blur_get_reach(cairo_surface_t *surface,
+                      enum swappy_blur_algorithm algorithm, guint radius) {
+  struct blur_kernel kernel;
+  gdouble scale_x, scale_y;
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+  blur_kernel_init(&kernel, algorithm, radius, scale_x, scale_y);
+  blur_kernel_clear(&kernel);
+
+  return kernel.apron / MIN(scale_x, scale_y);
+}
+
+/*
+ * Block until every background blur returned. Cancelled ones stop at the end
+ * of the pass they are in.
+ */
+void blur_wait_tasks(void) {
+  g_mutex_lock(&blur_tasks.mutex);
+  while (blur_tasks.running > 0) {
+    g_cond_wait(&blur_tasks.cond, &blur_tasks.mutex);
+  }
+  g_mutex_unlock(&blur_tasks.mutex);
+}
@@ -54,3 +54,36 @@ bool intersect_box(struct swappy_box *a, struct swappy_box *b) {
   };
   return !is_empty_box(&box);
 }
+
+bool contains_box(struct swappy_box *a, struct swappy_box *b) {
+  if (is_empty_box(b)) {
+    return true;
+  }
+
+  return a->x <= b->x && a->y <= b->y &&
+         a->x + a->width >= b->x + b->width &&
+         a->y + a->height >= b->y + b->height;
+}
+
+void union_box(struct swappy_box *a, struct swappy_box *b,
+               struct swappy_box *box) {
+  if (is_empty_box(a)) {
+    *box = *b;
+    return;
+  }
+
+  if (is_empty_box(b)) {
+    *box = *a;
+    return;
+  }
+
+  int32_t x1 = lmin(a->x, b->x);
+  int32_t y1 = lmin(a->y, b->y);
+  int32_t x2 = lmax(a->x + a->width, b->x + b->width);
+  int32_t y2 = lmax(a->y + a->height, b->y + b->height);
+
+  box->x = x1;
+  box->y = y1;
+  box->width = x2 - x1;
+  box->height = y2 - y1;
+}
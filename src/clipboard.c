@@ -1,90 +1,147 @@
 #include "clipboard.h"
 
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <unistd.h>
-
 #include "pixbuf.h"
 #include "util.h"
 
 #define gtk_clipboard_t GtkClipboard
 #define gdk_pixbuf_t GdkPixbuf
 
-static gboolean send_pixbuf_to_wl_copy(gdk_pixbuf_t *pixbuf) {
-  pid_t clipboard_process = 0;
-  int pipefd[2];
-  int status;
-  ssize_t written;
-  gsize size;
-  gchar *buffer = NULL;
-  GError *error = NULL;
+static void send_pixbuf_to_gdk_clipboard(gdk_pixbuf_t *pixbuf) {
+  gtk_clipboard_t *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
+  gtk_clipboard_set_image(clipboard, pixbuf);
+  gtk_clipboard_store(clipboard);  // Does not work for Wayland gdk backend
+}
 
-  if (pipe(pipefd) < 0) {
-    g_warning("unable to pipe for copy process to work");
-    return false;
-  }
-  clipboard_process = fork();
-  if (clipboard_process == -1) {
-    g_warning("unable to fork process for copy");
-    return false;
+/*
+ * A copy to the clipboard in progress: the PNG is written to wl-copy from a
+ * worker thread, then wl-copy is waited for without blocking the UI.
+ */
+struct clipboard_copy {
+  struct swappy_state *state;
+  struct swappy_export *export;
+  GSubprocess *process;
+};
+
+static void clipboard_copy_done(struct clipboard_copy *copy, gboolean copied) {
+  // Fall back to gtk function when `wl-copy` failed. See README.md.
+  if (!copied) {
+    gdk_pixbuf_t *pixbuf = pixbuf_export_get_pixbuf(copy->export);
+
+    if (pixbuf) {
+      send_pixbuf_to_gdk_clipboard(pixbuf);
+      g_object_unref(pixbuf);
+    } else {
+      g_warning("unable to convert drawing area to pixbuf for the clipboard");
+    }
   }
-  if (clipboard_process == 0) {
-    close(pipefd[1]);
-    dup2(pipefd[0], STDIN_FILENO);
-    close(pipefd[0]);
-    execlp("wl-copy", "wl-copy", "-t", "image/png", NULL);
-    g_warning(
-        "Unable to copy contents to clipboard. Please make sure you have "
-        "`wl-clipboard`, `xclip`, or `xsel` installed.");
-    exit(1);
+
+  // Copies still in progress at exit are finished after the main loop returned
+  if (copy->state->config->early_exit && gtk_main_level() > 0) {
+    gtk_main_quit();
   }
-  close(pipefd[0]);
 
-  gdk_pixbuf_save_to_buffer(pixbuf, &buffer, &size, "png", &error, NULL);
+  copy->state->clipboard_copies--;
+  pixbuf_export_unref(copy->export);
+  g_clear_object(&copy->process);
+  g_free(copy);
+}
+
+static void on_wl_copy_exited(GObject *source_object, GAsyncResult *result,
+                              gpointer user_data) {
+  struct clipboard_copy *copy = user_data;
+  GError *error = NULL;
+  gboolean copied = g_subprocess_wait_check_finish(G_SUBPROCESS(source_object),
+                                                   result, &error);
 
-  if (error != NULL) {
-    g_critical("unable to save pixbuf to buffer for copy: %s", error->message);
+  if (!copied) {
+    g_warning("wl-copy did not exit properly: %s", error->message);
     g_error_free(error);
-    return false;
   }
 
-  written = write(pipefd[1], buffer, size);
-  if (written == -1) {
-    g_warning("unable to write to pipe fd for copy");
-    g_free(buffer);
-    return false;
-  }
+  clipboard_copy_done(copy, copied);
+}
+
+static void write_png_thread(GTask *task, gpointer source_object,
+                             gpointer task_data, GCancellable *cancellable) {
+  struct clipboard_copy *copy = task_data;
+  GOutputStream *in = g_subprocess_get_stdin_pipe(copy->process);
+  GError *error = NULL;
 
-  close(pipefd[1]);
-  g_free(buffer);
-  waitpid(clipboard_process, &status, 0);
+  // wl-copy reads the image while it is being encoded, partial writes are
+  // taken care of by the stream. The encoding is not kept in memory on top of
+  // what wl-copy holds.
+  gboolean written = pixbuf_export_write_png(copy->export, in, FALSE, &error);
 
-  if (WIFEXITED(status)) {
-    return WEXITSTATUS(status) == 0;  // Make sure the child exited properly
+  // wl-copy needs to see the end of its input either way
+  g_output_stream_close(in, NULL, NULL);
+
+  if (!written) {
+    g_task_return_error(task, error);
+    return;
   }
 
-  return false;
+  g_task_return_boolean(task, TRUE);
 }
 
-static void send_pixbuf_to_gdk_clipboard(gdk_pixbuf_t *pixbuf) {
-  gtk_clipboard_t *clipboard = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
-  gtk_clipboard_set_image(clipboard, pixbuf);
-  gtk_clipboard_store(clipboard);  // Does not work for Wayland gdk backend
+static void on_png_written(GObject *source_object, GAsyncResult *result,
+                           gpointer user_data) {
+  struct clipboard_copy *copy = user_data;
+  GError *error = NULL;
+
+  if (!g_task_propagate_boolean(G_TASK(result), &error)) {
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_BROKEN_PIPE)) {
+      g_warning("wl-copy exited before reading the whole image");
+    } else {
+      g_warning("unable to write to pipe fd for copy: %s", error->message);
+    }
+    g_error_free(error);
+    clipboard_copy_done(copy, false);
+    return;
+  }
+
+  g_subprocess_wait_check_async(copy->process, NULL, on_wl_copy_exited, copy);
 }
 
 bool clipboard_copy_drawing_area_to_selection(struct swappy_state *state) {
-  gdk_pixbuf_t *pixbuf = pixbuf_get_from_state(state);
+  struct clipboard_copy *copy;
+  GError *error = NULL;
+  GTask *task;
 
-  // Try `wl-copy` first and fall back to gtk function. See README.md.
-  if (!send_pixbuf_to_wl_copy(pixbuf)) {
-    send_pixbuf_to_gdk_clipboard(pixbuf);
-  }
+  copy = g_new0(struct clipboard_copy, 1);
+  copy->state = state;
+  copy->export = pixbuf_export_get(state);
+  state->clipboard_copies++;
 
-  g_object_unref(pixbuf);
+  // Try `wl-copy` first and fall back to gtk function. See README.md.
+  // GSubprocess spawns it without duplicating our address space when it can.
+  copy->process = g_subprocess_new(G_SUBPROCESS_FLAGS_STDIN_PIPE, &error,
+                                   "wl-copy", "-t", "image/png", NULL);
 
-  if (state->config->early_exit) {
-    gtk_main_quit();
+  if (copy->process == NULL) {
+    g_warning(
+        "Unable to copy contents to clipboard. Please make sure you have "
+        "`wl-clipboard`, `xclip`, or `xsel` installed.");
+    g_info("unable to spawn wl-copy: %s", error->message);
+    g_error_free(error);
+    clipboard_copy_done(copy, false);
+    return true;
   }
 
+  task = g_task_new(NULL, NULL, on_png_written, copy);
+  g_task_set_task_data(task, copy, NULL);
+  g_task_run_in_thread(task, write_png_thread);
+  g_object_unref(task);
+
   return true;
 }
+
+/*
+ * Finish the copies still streaming the image to wl-copy, fallback included.
+ * Only called once the main loop returned: their callbacks are dispatched
+ * from here, so that exiting right after a copy does not truncate it.
+ */
+void clipboard_wait(struct swappy_state *state) {
+  while (state->clipboard_copies > 0) {
+    g_main_context_iteration(NULL, TRUE);
+  }
+}
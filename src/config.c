@@ -26,6 +26,11 @@ static void print_config(struct swappy_config *config) {
   g_info("auto_save: %d", config->auto_save);
   g_info("custom_color: %s", config->custom_color);
   g_info("transparent: %d", config->transparent);
+  g_info("blur_threads: %d", config->blur_threads);
+  g_info("blur_algorithm: %d", config->blur_algorithm);
+  g_info("blur_radius: %d", config->blur_radius);
+  g_info("png_compression: %d", config->png_compression);
+  g_info("brush_tolerance: %g", config->brush_tolerance);
 }
 
 static char *get_default_save_dir() {
@@ -89,6 +94,11 @@ static void load_config_from_file(struct swappy_config *config,
   gboolean auto_save;
   gchar *custom_color = NULL;
   gboolean transparent;
+  guint64 blur_threads;
+  gchar *blur_algorithm = NULL;
+  guint64 blur_radius;
+  guint64 png_compression;
+  gdouble brush_tolerance;
   GError *error = NULL;
 
   if (file == NULL) {
@@ -236,6 +246,8 @@ static void load_config_from_file(struct swappy_config *config,
       config->paint_mode = SWAPPY_PAINT_MODE_ARROW;
     } else if (g_ascii_strcasecmp(paint_mode, "blur") == 0) {
       config->paint_mode = SWAPPY_PAINT_MODE_BLUR;
+    } else if (g_ascii_strcasecmp(paint_mode, "pixelate") == 0) {
+      config->paint_mode = SWAPPY_PAINT_MODE_PIXELATE;
     } else {
       g_warning(
           "paint_mode is not a valid value: %s - see man page for details",
@@ -287,6 +299,92 @@ static void load_config_from_file(struct swappy_config *config,
     error = NULL;
   }
 
+  blur_threads = g_key_file_get_uint64(gkf, group, "blur_threads", &error);
+
+  if (error == NULL) {
+    if (blur_threads <= SWAPPY_BLUR_THREADS_MAX) {
+      config->blur_threads = blur_threads;
+    } else {
+      g_warning("blur_threads is not a valid value: %" PRIu64
+                " - see man page for details",
+                blur_threads);
+    }
+  } else {
+    g_info("blur_threads is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  blur_algorithm = g_key_file_get_string(gkf, group, "blur_algorithm", &error);
+
+  if (error == NULL) {
+    if (g_ascii_strcasecmp(blur_algorithm, "gaussian") == 0) {
+      config->blur_algorithm = SWAPPY_BLUR_ALGORITHM_GAUSSIAN;
+    } else if (g_ascii_strcasecmp(blur_algorithm, "box") == 0) {
+      config->blur_algorithm = SWAPPY_BLUR_ALGORITHM_BOX;
+    } else {
+      g_warning(
+          "blur_algorithm is not a valid value: %s - see man page for details",
+          blur_algorithm);
+    }
+    g_free(blur_algorithm);
+  } else {
+    g_info("blur_algorithm is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  blur_radius = g_key_file_get_uint64(gkf, group, "blur_radius", &error);
+
+  if (error == NULL) {
+    if (blur_radius >= SWAPPY_BLUR_RADIUS_MIN &&
+        blur_radius <= SWAPPY_BLUR_RADIUS_MAX) {
+      config->blur_radius = blur_radius;
+    } else {
+      g_warning("blur_radius is not a valid value: %" PRIu64
+                " - see man page for details",
+                blur_radius);
+    }
+  } else {
+    g_info("blur_radius is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  png_compression =
+      g_key_file_get_uint64(gkf, group, "png_compression", &error);
+
+  if (error == NULL) {
+    if (png_compression <= SWAPPY_PNG_COMPRESSION_MAX) {
+      config->png_compression = png_compression;
+    } else {
+      g_warning("png_compression is not a valid value: %" PRIu64
+                " - see man page for details",
+                png_compression);
+    }
+  } else {
+    g_info("png_compression is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  brush_tolerance =
+      g_key_file_get_double(gkf, group, "brush_tolerance", &error);
+
+  if (error == NULL) {
+    if (brush_tolerance >= 0 && brush_tolerance <= SWAPPY_BRUSH_TOLERANCE_MAX) {
+      config->brush_tolerance = brush_tolerance;
+    } else {
+      g_warning("brush_tolerance is not a valid value: %g"
+                " - see man page for details",
+                brush_tolerance);
+    }
+  } else {
+    g_info("brush_tolerance is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
   g_key_file_free(gkf);
 }
 
@@ -308,6 +406,11 @@ static void load_default_config(struct swappy_config *config) {
   config->custom_color = g_strdup(CONFIG_CUSTOM_COLOR_DEFAULT);
   config->transparent = CONFIG_TRANSPARENT_DEFAULT;
   config->transparency = CONFIG_TRANSPARENCY_DEFAULT;
+  config->blur_threads = CONFIG_BLUR_THREADS_DEFAULT;
+  config->blur_algorithm = CONFIG_BLUR_ALGORITHM_DEFAULT;
+  config->blur_radius = CONFIG_BLUR_RADIUS_DEFAULT;
+  config->png_compression = CONFIG_PNG_COMPRESSION_DEFAULT;
+  config->brush_tolerance = CONFIG_BRUSH_TOLERANCE_DEFAULT;
 }
 
 void config_load(struct swappy_state *state) {
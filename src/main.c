@@ -1,5 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <signal.h>
+
 #include "application.h"
 #include "config.h"
 
@@ -11,6 +13,9 @@ int main(int argc, char *argv[]) {
   state.argv = argv;
   state.mode = SWAPPY_PAINT_MODE_BRUSH;
 
+  // Readers such as wl-copy may go away early, make it a write error instead
+  signal(SIGPIPE, SIG_IGN);
+
   if (!application_init(&state)) {
     g_critical("failed to initialize gtk application");
     exit(1);
@@ -1,11 +1,27 @@
 #include "paint.h"
 
 #include <glib.h>
+#include <math.h>
 #include <stdio.h>
 
+#include "blur.h"
 #include "gtk/gtk.h"
 #include "util.h"
 
+/* Points preallocated for a new brush stroke */
+#define PAINT_BRUSH_POINTS_SIZE 256
+
+/* Segments approaching each curve of a smoothed stroke when measuring it */
+#define PAINT_BRUSH_CURVE_SAMPLES 16
+
+static void grow_brush_bounds(struct swappy_paint_brush *brush,
+                              struct swappy_point point) {
+  brush->min.x = MIN(brush->min.x, point.x);
+  brush->min.y = MIN(brush->min.y, point.y);
+  brush->max.x = MAX(brush->max.x, point.x);
+  brush->max.y = MAX(brush->max.y, point.y);
+}
+
 static void cursor_move_backward(struct swappy_paint_text *text) {
   if (text->cursor > 0) {
     text->cursor--;
@@ -18,6 +34,20 @@ static void cursor_move_forward(struct swappy_paint_text *text) {
   }
 }
 
+void paint_cancel_pending(struct swappy_paint *paint) {
+  switch (paint->type) {
+    case SWAPPY_PAINT_MODE_BLUR:
+      if (paint->content.blur.cancellable) {
+        g_cancellable_cancel(paint->content.blur.cancellable);
+        g_clear_object(&paint->content.blur.cancellable);
+      }
+      g_clear_pointer(&paint->content.blur.job, blur_job_unref);
+      break;
+    default:
+      break;
+  }
+}
+
 void paint_free(gpointer data) {
   struct swappy_paint *paint = (struct swappy_paint *)data;
 
@@ -30,9 +60,18 @@ void paint_free(gpointer data) {
       if (paint->content.blur.surface) {
         cairo_surface_destroy(paint->content.blur.surface);
       }
+      if (paint->content.blur.preview) {
+        cairo_surface_destroy(paint->content.blur.preview);
+      }
+      paint_cancel_pending(paint);
+      break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      if (paint->content.pixelate.surface) {
+        cairo_surface_destroy(paint->content.pixelate.surface);
+      }
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
-      g_list_free_full(paint->content.brush.points, g_free);
+      g_array_unref(paint->content.brush.points);
       break;
     case SWAPPY_PAINT_MODE_TEXT:
       g_free(paint->content.text.text);
@@ -61,7 +100,7 @@ void paint_free_all(struct swappy_state *state) {
 void paint_add_temporary(struct swappy_state *state, double x, double y,
                          enum swappy_paint_type type) {
   struct swappy_paint *paint = g_new(struct swappy_paint, 1);
-  struct swappy_point *point;
+  struct swappy_point point = {x, y};
 
   double r = state->settings.r;
   double g = state->settings.g;
@@ -93,6 +132,16 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
       paint->content.blur.from.x = x;
       paint->content.blur.from.y = y;
       paint->content.blur.surface = NULL;
+      paint->content.blur.preview = NULL;
+      paint->content.blur.cancellable = NULL;
+      paint->content.blur.job = NULL;
+      break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      paint->can_draw = false;
+
+      paint->content.pixelate.from.x = x;
+      paint->content.pixelate.from.y = y;
+      paint->content.pixelate.surface = NULL;
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
       paint->can_draw = true;
@@ -103,11 +152,13 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
       paint->content.brush.a = a;
       paint->content.brush.w = w;
 
-      point = g_new(struct swappy_point, 1);
-      point->x = x;
-      point->y = y;
-
-      paint->content.brush.points = g_list_prepend(NULL, point);
+      paint->content.brush.points = g_array_sized_new(
+          FALSE, FALSE, sizeof(struct swappy_point), PAINT_BRUSH_POINTS_SIZE);
+      g_array_append_val(paint->content.brush.points, point);
+      paint->content.brush.min = point;
+      paint->content.brush.max = point;
+      paint->content.brush.rendered = 0;
+      paint->content.brush.smooth = FALSE;
       break;
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
@@ -155,8 +206,7 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
 void paint_update_temporary_shape(struct swappy_state *state, double x,
                                   double y, gboolean is_control_pressed) {
   struct swappy_paint *paint = state->temp_paint;
-  struct swappy_point *point;
-  GList *points;
+  struct swappy_point point = {x, y};
 
   if (!paint) {
     return;
@@ -168,13 +218,15 @@ void paint_update_temporary_shape(struct swappy_state *state, double x,
       paint->content.blur.to.x = x;
       paint->content.blur.to.y = y;
       break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      paint->can_draw = true;
+      paint->content.pixelate.to.x = x;
+      paint->content.pixelate.to.y = y;
+      break;
     case SWAPPY_PAINT_MODE_BRUSH:
-      points = paint->content.brush.points;
-      point = g_new(struct swappy_point, 1);
-      point->x = x;
-      point->y = y;
-
-      paint->content.brush.points = g_list_prepend(points, point);
+      // Grows geometrically, appending is amortized constant time
+      g_array_append_val(paint->content.brush.points, point);
+      grow_brush_bounds(&paint->content.brush, point);
       break;
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
@@ -286,6 +338,227 @@ void paint_update_temporary_text_clip(struct swappy_state *state, gdouble x,
   gtk_im_context_focus_in(state->ui->im_context);
 }
 
+static gdouble get_segment_distance(struct swappy_point p,
+                                    struct swappy_point a,
+                                    struct swappy_point b) {
+  gdouble dx = b.x - a.x;
+  gdouble dy = b.y - a.y;
+  gdouble length = dx * dx + dy * dy;
+  gdouble t = 0;
+
+  if (length > 0) {
+    t = CLAMP(((p.x - a.x) * dx + (p.y - a.y) * dy) / length, 0, 1);
+  }
+
+  return hypot(p.x - (a.x + t * dx), p.y - (a.y + t * dy));
+}
+
+/*
+ * Ramer-Douglas-Peucker: mark in `keep` the points further than `tolerance`
+ * from the segment joining the points kept around them. Ranges left to look at
+ * are kept on a stack instead of being recursed into, strokes can be long.
+ */
+static void simplify_points(struct swappy_point *points, guint len,
+                            gdouble tolerance, gboolean *keep) {
+  GArray *ranges = g_array_new(FALSE, FALSE, sizeof(guint));
+  guint range[4] = {0, len - 1};
+
+  keep[0] = TRUE;
+  keep[len - 1] = TRUE;
+  g_array_append_vals(ranges, range, 2);
+
+  while (ranges->len > 0) {
+    guint first = g_array_index(ranges, guint, ranges->len - 2);
+    guint last = g_array_index(ranges, guint, ranges->len - 1);
+    guint farthest = first;
+    gdouble max = 0;
+
+    g_array_set_size(ranges, ranges->len - 2);
+
+    for (guint i = first + 1; i < last; i++) {
+      gdouble distance =
+          get_segment_distance(points[i], points[first], points[last]);
+      if (distance > max) {
+        max = distance;
+        farthest = i;
+      }
+    }
+
+    if (max > tolerance) {
+      keep[farthest] = TRUE;
+      range[0] = first;
+      range[1] = farthest;
+      range[2] = farthest;
+      range[3] = last;
+      g_array_append_vals(ranges, range, 4);
+    }
+  }
+
+  g_array_unref(ranges);
+}
+
+/*
+ * Control points of the bezier curve going from knot `i` to the next one.
+ * This is a Catmull-Rom spline whose tangents are scaled down to the length of
+ * the segment, knots left by simplify_points() are unevenly spaced and evenly
+ * sized tangents would make loops around the shortest segments.
+ */
+static void get_spline_controls(struct swappy_point *knots, guint len, guint i,
+                                struct swappy_point *c1,
+                                struct swappy_point *c2) {
+  struct swappy_point p0 = knots[i > 0 ? i - 1 : 0];
+  struct swappy_point p1 = knots[i];
+  struct swappy_point p2 = knots[i + 1];
+  struct swappy_point p3 = knots[MIN(i + 2, len - 1)];
+  gdouble d01 = hypot(p1.x - p0.x, p1.y - p0.y);
+  gdouble d12 = hypot(p2.x - p1.x, p2.y - p1.y);
+  gdouble d23 = hypot(p3.x - p2.x, p3.y - p2.y);
+  gdouble t1 = d01 + d12 > 0 ? d12 / (3 * (d01 + d12)) : 0;
+  gdouble t2 = d12 + d23 > 0 ? d12 / (3 * (d12 + d23)) : 0;
+
+  c1->x = p1.x + (p2.x - p0.x) * t1;
+  c1->y = p1.y + (p2.y - p0.y) * t1;
+  c2->x = p2.x - (p3.x - p1.x) * t2;
+  c2->y = p2.y - (p3.y - p1.y) * t2;
+}
+
+void paint_brush_get_controls(struct swappy_paint_brush *brush, guint i,
+                              struct swappy_point *c1,
+                              struct swappy_point *c2) {
+  get_spline_controls((struct swappy_point *)brush->points->data,
+                      brush->points->len, i, c1, c2);
+}
+
+/*
+ * Distance from a point to a bezier curve, measured to the polyline of
+ * PAINT_BRUSH_CURVE_SAMPLES segments approaching it.
+ */
+static gdouble get_curve_distance(struct swappy_point p, struct swappy_point p1,
+                                  struct swappy_point c1,
+                                  struct swappy_point c2,
+                                  struct swappy_point p2) {
+  struct swappy_point from = p1;
+  gdouble distance = G_MAXDOUBLE;
+
+  for (guint s = 1; s <= PAINT_BRUSH_CURVE_SAMPLES; s++) {
+    gdouble t = (gdouble)s / PAINT_BRUSH_CURVE_SAMPLES;
+    gdouble u = 1 - t;
+    struct swappy_point to = {
+        u * u * u * p1.x + 3 * u * u * t * c1.x + 3 * u * t * t * c2.x +
+            t * t * t * p2.x,
+        u * u * u * p1.y + 3 * u * u * t * c1.y + 3 * u * t * t * c2.y +
+            t * t * t * p2.y,
+    };
+
+    distance = MIN(distance, get_segment_distance(p, from, to));
+    from = to;
+  }
+
+  return distance;
+}
+
+/*
+ * The spline through the kept points can stray further from the points in
+ * between than the segments simplify_points() measured, mostly around sharp
+ * corners. Keep the farthest point of every curve that strays further than
+ * `tolerance`, returns whether any was. `knots` and `indices` are scratch
+ * arrays.
+ */
+static gboolean refine_points(struct swappy_point *points, guint len,
+                              gdouble tolerance, gboolean *keep,
+                              GArray *knots, GArray *indices) {
+  struct swappy_point c1, c2;
+  gboolean refined = FALSE;
+
+  g_array_set_size(knots, 0);
+  g_array_set_size(indices, 0);
+
+  for (guint i = 0; i < len; i++) {
+    if (keep[i]) {
+      g_array_append_val(knots, points[i]);
+      g_array_append_val(indices, i);
+    }
+  }
+
+  for (guint k = 0; k + 1 < knots->len; k++) {
+    struct swappy_point *knot = (struct swappy_point *)knots->data;
+    guint first = g_array_index(indices, guint, k);
+    guint last = g_array_index(indices, guint, k + 1);
+    guint farthest = first;
+    gdouble max = 0;
+
+    get_spline_controls(knot, knots->len, k, &c1, &c2);
+
+    for (guint i = first + 1; i < last; i++) {
+      gdouble distance =
+          get_curve_distance(points[i], knot[k], c1, c2, knot[k + 1]);
+      if (distance > max) {
+        max = distance;
+        farthest = i;
+      }
+    }
+
+    if (max > tolerance) {
+      keep[farthest] = TRUE;
+      refined = TRUE;
+    }
+  }
+
+  return refined;
+}
+
+/*
+ * Motion events come in far more often than needed to describe a stroke. Once
+ * it is done, keep only the points that matter and draw a spline through them
+ * that stays within `tolerance` of every point drawn.
+ */
+static void commit_brush(struct swappy_paint_brush *brush, gdouble tolerance) {
+  struct swappy_point *points = (struct swappy_point *)brush->points->data;
+  guint len = brush->points->len;
+  gboolean *keep;
+  GArray *knots, *indices;
+  struct swappy_point c1, c2;
+
+  if (tolerance <= 0 || len < 3) {
+    return;
+  }
+
+  keep = g_new0(gboolean, len);
+  knots = g_array_new(FALSE, FALSE, sizeof(struct swappy_point));
+  indices = g_array_new(FALSE, FALSE, sizeof(guint));
+
+  simplify_points(points, len, tolerance, keep);
+  while (refine_points(points, len, tolerance, keep, knots, indices)) {
+    // Knots added change the tangents of the curves around them, measure again
+  }
+
+  g_debug("brush simplified from %u to %u points", len, knots->len);
+
+  // The array points were appended to has room for many more, only keep what
+  // is needed
+  g_array_unref(brush->points);
+  brush->points =
+      g_array_sized_new(FALSE, FALSE, sizeof(struct swappy_point), knots->len);
+  g_array_append_vals(brush->points, knots->data, knots->len);
+  brush->smooth = TRUE;
+
+  g_array_unref(indices);
+  g_array_unref(knots);
+  g_free(keep);
+
+  // Curves stay within their control points, which can be out of the bounds
+  // of the points themselves
+  points = (struct swappy_point *)brush->points->data;
+  brush->min = points[0];
+  brush->max = points[0];
+  for (guint i = 0; i < brush->points->len - 1; i++) {
+    paint_brush_get_controls(brush, i, &c1, &c2);
+    grow_brush_bounds(brush, c1);
+    grow_brush_bounds(brush, c2);
+    grow_brush_bounds(brush, points[i + 1]);
+  }
+}
+
 void paint_commit_temporary(struct swappy_state *state) {
   struct swappy_paint *paint = state->temp_paint;
 
@@ -300,6 +573,9 @@ void paint_commit_temporary(struct swappy_state *state) {
       }
       paint->content.text.mode = SWAPPY_TEXT_MODE_DONE;
       break;
+    case SWAPPY_PAINT_MODE_BRUSH:
+      commit_brush(&paint->content.brush, state->config->brush_tolerance);
+      break;
     default:
       break;
   }
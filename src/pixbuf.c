@@ -1,28 +1,375 @@
 #include "pixbuf.h"
 
 #include <cairo/cairo.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
+#include <glib/gstdio.h>
+#include <png.h>
+#include <unistd.h>
 
-GdkPixbuf *pixbuf_get_from_state(struct swappy_state *state) {
-  guint width = cairo_image_surface_get_width(state->rendering_surface);
-  guint height = cairo_image_surface_get_height(state->rendering_surface);
-  GdkPixbuf *pixbuf = gdk_pixbuf_get_from_surface(state->rendering_surface, 0,
-                                                  0, width, height);
+#include "box.h"
+#include "render.h"
 
-  return pixbuf;
+// Large enough to keep up with a compositor dumping a full screen to a pipe,
+// small enough for decoded rows to show up while the image is loading
+#define PIXBUF_LOAD_BLOCK_SIZE (64 * 1024)
+
+struct swappy_export *pixbuf_export_get(struct swappy_state *state) {
+  struct swappy_export *export;
+
+  // Rows still being decoded, blurs still computed in the background and
+  // changes waiting for the next frame are all part of what is exported
+  pixbuf_wait_loaded(state);
+  render_finish_blurs(state);
+  render_flush(state);
+  export = state->export;
+
+  if (export && export->generation == state->render_generation) {
+    return pixbuf_export_ref(export);
+  }
+
+  pixbuf_export_unref(export);
+
+  export = g_new0(struct swappy_export, 1);
+  export->ref_count = 1;
+  export->generation = state->render_generation;
+  export->compression = state->config->png_compression;
+  export->surface = cairo_surface_reference(state->rendering_surface);
+  g_mutex_init(&export->mutex);
+
+  cairo_surface_flush(export->surface);
+
+  state->export = export;
+
+  return pixbuf_export_ref(export);
+}
+
+struct swappy_export *pixbuf_export_ref(struct swappy_export *export) {
+  g_atomic_int_inc(&export->ref_count);
+  return export;
+}
+
+void pixbuf_export_unref(struct swappy_export *export) {
+  if (!export || !g_atomic_int_dec_and_test(&export->ref_count)) {
+    return;
+  }
+
+  if (export->png) {
+    g_bytes_unref(export->png);
+  }
+  g_mutex_clear(&export->mutex);
+  cairo_surface_destroy(export->surface);
+  g_free(export);
+}
+
+void pixbuf_export_detach(struct swappy_state *state) {
+  struct swappy_export *export = state->export;
+
+  if (!export || export->surface != state->rendering_surface) {
+    return;
+  }
+
+  state->export = NULL;
+
+  // Only sinks take references besides state, and they never take new ones
+  if (g_atomic_int_get(&export->ref_count) > 1) {
+    cairo_surface_t *surface = state->rendering_surface;
+    gdouble scale_x, scale_y;
+
+    cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+    cairo_surface_t *copy = cairo_image_surface_create(
+        cairo_image_surface_get_format(surface),
+        cairo_image_surface_get_width(surface),
+        cairo_image_surface_get_height(surface));
+    cairo_surface_set_device_scale(copy, scale_x, scale_y);
+
+    cairo_t *cr = cairo_create(copy);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cr, surface, 0, 0);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+
+    cairo_surface_destroy(surface);
+    state->rendering_surface = copy;
+  }
+
+  pixbuf_export_unref(export);
+}
+
+/*
+ * Convert the export to a new pixbuf, NULL when the conversion fails.
+ */
+GdkPixbuf *pixbuf_export_get_pixbuf(struct swappy_export *export) {
+  return gdk_pixbuf_get_from_surface(
+      export->surface, 0, 0, cairo_image_surface_get_width(export->surface),
+      cairo_image_surface_get_height(export->surface));
+}
+
+/*
+ * Streams the encoded PNG to `out` and collects it in `bytes`, each when set.
+ * When it is collected, encoding goes on after a write error so that the PNG
+ * can still be cached.
+ */
+struct png_writer {
+  GByteArray *bytes;
+  GOutputStream *out;
+  GError *out_error;
+};
+
+static void png_write_data(png_structp png, png_bytep data, png_size_t length) {
+  struct png_writer *writer = png_get_io_ptr(png);
+
+  if (writer->bytes) {
+    g_byte_array_append(writer->bytes, data, length);
+  }
+
+  if (writer->out && writer->out_error == NULL &&
+      !g_output_stream_write_all(writer->out, data, length, NULL, NULL,
+                                 &writer->out_error) &&
+      writer->bytes == NULL) {
+    png_error(png, "unable to write png");
+  }
+}
+
+static void png_flush_data(png_structp png) {}
+
+/*
+ * Encode an ARGB32 or RGB24 image surface to PNG. Pixels are un-premultiplied
+ * one row at a time into a single scanline, the surface is never copied.
+ */
+static gboolean encode_png(cairo_surface_t *surface, guint32 compression,
+                           struct png_writer *writer, GError **error) {
+  png_structp png;
+  png_infop info = NULL;
+  uint8_t *volatile row = NULL;
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  int width = cairo_image_surface_get_width(surface);
+  int height = cairo_image_surface_get_height(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  const uint8_t *data = cairo_image_surface_get_data(surface);
+
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                "surface format: %d is not supported", format);
+    return FALSE;
+  }
+
+  png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (png) {
+    info = png_create_info_struct(png);
+  }
+
+  if (!info) {
+    png_destroy_write_struct(&png, NULL);
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "unable to create png encoder");
+    return FALSE;
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    g_free(row);
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "unable to encode png");
+    return FALSE;
+  }
+
+  row = g_new(uint8_t, (gsize)width * 4);
+
+  png_set_write_fn(png, writer, png_write_data, png_flush_data);
+  png_set_compression_level(png, compression);
+  png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  png_write_info(png, info);
+
+  for (int y = 0; y < height; y++) {
+    const uint32_t *pixels = (const uint32_t *)(data + (ptrdiff_t)y * stride);
+
+    for (int x = 0; x < width; x++) {
+      uint32_t pixel = pixels[x];
+      uint8_t *p = row + x * 4;
+      uint32_t alpha = format == CAIRO_FORMAT_ARGB32 ? pixel >> 24 : 0xff;
+
+      if (alpha == 0) {
+        p[0] = p[1] = p[2] = p[3] = 0;
+      } else {
+        p[0] = (((pixel >> 16) & 0xff) * 255 + alpha / 2) / alpha;
+        p[1] = (((pixel >> 8) & 0xff) * 255 + alpha / 2) / alpha;
+        p[2] = ((pixel & 0xff) * 255 + alpha / 2) / alpha;
+        p[3] = alpha;
+      }
+    }
+
+    png_write_row(png, row);
+  }
+
+  png_write_end(png, info);
+  png_destroy_write_struct(&png, &info);
+  g_free(row);
+
+  return TRUE;
+}
+
+/*
+ * Encode the export unless it already is, writing the PNG to `out` on the way
+ * when set. Must be called with the export mutex held.
+ */
+static gboolean export_encode_locked(struct swappy_export *export,
+                                     GOutputStream *out, gboolean cache,
+                                     GError **error) {
+  struct png_writer writer = {
+      .bytes = cache ? g_byte_array_new() : NULL,
+      .out = out,
+      .out_error = NULL,
+  };
+  GError *encode_error = NULL;
+  gboolean encoded = encode_png(export->surface, export->compression, &writer,
+                                &encode_error);
+
+  if (writer.bytes && encoded) {
+    export->png = g_byte_array_free_to_bytes(writer.bytes);
+  } else if (writer.bytes) {
+    g_byte_array_unref(writer.bytes);
+  }
+
+  // When nothing is collected, the encoder stops at the first failed write
+  if (writer.out_error != NULL) {
+    g_clear_error(&encode_error);
+    g_propagate_error(error, writer.out_error);
+    return FALSE;
+  }
+
+  if (!encoded) {
+    g_propagate_error(error, encode_error);
+    return FALSE;
+  }
+
+  return TRUE;
 }
 
-static void write_file(GdkPixbuf *pixbuf, char *path) {
+/*
+ * Write the PNG encoding of the export to `out`. If it still has to be
+ * encoded, it is written as it is produced so that the reader does not wait
+ * for the whole image. With `cache`, the encoding is also kept in memory for
+ * the next sinks of the same frame. Safe to call from any thread.
+ */
+gboolean pixbuf_export_write_png(struct swappy_export *export,
+                                 GOutputStream *out, gboolean cache,
+                                 GError **error) {
+  gboolean written;
+
+  g_mutex_lock(&export->mutex);
+
+  if (export->png) {
+    gsize size;
+    gconstpointer data = g_bytes_get_data(export->png, &size);
+
+    written = g_output_stream_write_all(out, data, size, NULL, NULL, error);
+  } else {
+    written = export_encode_locked(export, out, cache, error);
+  }
+
+  g_mutex_unlock(&export->mutex);
+
+  return written;
+}
+
+/*
+ * An export to write by the save pool. A NULL path stands for stdout.
+ */
+struct pixbuf_save_job {
+  struct swappy_export *export;
+  char *path;
+};
+
+/*
+ * Files are written in place, like the image loaders of gdk-pixbuf do: targets
+ * such as /dev/stdout, FIFOs or symbolic links are written through.
+ */
+static gboolean write_png_to_fd(struct swappy_export *export, int fd,
+                                GError **error) {
+  GOutputStream *out = g_unix_output_stream_new(fd, TRUE);
+  gboolean written = pixbuf_export_write_png(export, out, TRUE, error);
+
+  // Closing can fail too, only the first error is kept
+  if (!g_output_stream_close(out, NULL, written ? error : NULL)) {
+    written = FALSE;
+  }
+
+  g_object_unref(out);
+
+  return written;
+}
+
+static void save_job_run(gpointer data, gpointer user_data) {
+  struct pixbuf_save_job *job = data;
   GError *error = NULL;
-  gdk_pixbuf_savev(pixbuf, path, "png", NULL, NULL, &error);
 
-  if (error != NULL) {
-    g_critical("unable to save drawing area to pixbuf: %s", error->message);
-    g_error_free(error);
+  if (job->path) {
+    int fd = g_open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd < 0) {
+      int saved_errno = errno;
+      g_set_error(&error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                  "failed to open '%s' for writing: %s", job->path,
+                  g_strerror(saved_errno));
+    } else {
+      write_png_to_fd(job->export, fd, &error);
+    }
+
+    if (error != NULL) {
+      g_critical("unable to save drawing area to pixbuf: %s", error->message);
+      g_error_free(error);
+    }
+  } else {
+    write_png_to_fd(job->export, STDOUT_FILENO, &error);
+
+    if (error != NULL) {
+      g_warning("unable to save surface to stdout: %s", error->message);
+      g_error_free(error);
+    }
   }
+
+  g_free(job->path);
+  pixbuf_export_unref(job->export);
+  g_free(job);
 }
 
-void pixbuf_save_state_to_folder(GdkPixbuf *pixbuf, char *folder,
+/*
+ * Encoding a large capture takes a while, it happens on a worker thread so
+ * that the window stays responsive. There is a single worker: saves are
+ * written in the order they were requested.
+ */
+static void save_in_background(struct swappy_state *state,
+                               struct swappy_export *export,
+                               const char *path) {
+  struct pixbuf_save_job *job = g_new(struct pixbuf_save_job, 1);
+  GError *error = NULL;
+
+  job->export = pixbuf_export_ref(export);
+  job->path = g_strdup(path);
+
+  if (!state->save_pool) {
+    state->save_pool = g_thread_pool_new(save_job_run, NULL, 1, FALSE, &error);
+
+    if (error != NULL) {
+      g_warning("unable to create save thread pool: %s", error->message);
+      g_error_free(error);
+      state->save_pool = NULL;
+    }
+  }
+
+  if (!state->save_pool || !g_thread_pool_push(state->save_pool, job, NULL)) {
+    save_job_run(job, NULL);
+  }
+}
+
+void pixbuf_save_state_to_folder(struct swappy_state *state,
+                                 struct swappy_export *export, char *folder,
                                  char *filename_format) {
   time_t current_time = time(NULL);
   char *c_time_string;
@@ -43,90 +390,535 @@ void pixbuf_save_state_to_folder(GdkPixbuf *pixbuf, char *folder,
 
   g_snprintf(path, MAX_PATH, "%s/%s", folder, filename);
   g_info("saving surface to path: %s", path);
-  write_file(pixbuf, path);
+  save_in_background(state, export, path);
 }
 
-void pixbuf_save_to_stdout(GdkPixbuf *pixbuf) {
-  GOutputStream *out;
-  GError *error = NULL;
+void pixbuf_save_to_stdout(struct swappy_state *state,
+                           struct swappy_export *export) {
+  save_in_background(state, export, NULL);
+}
+
+static gboolean is_file_from_stdin(const char *file) {
+  return (g_strcmp0(file, "-") == 0);
+}
 
-  out = g_unix_output_stream_new(STDOUT_FILENO, TRUE);
+/*
+ * Image being decoded: chunks are read from the input on the main loop and
+ * decoded straight into original_image_surface. PNG images are decoded with
+ * libpng row by row, other formats go through a GdkPixbufLoader.
+ */
+struct pixbuf_load {
+  struct swappy_state *state;
+  GInputStream *in;
+  /* Reads the next chunk once the input has one, or when idle */
+  GSource *source;
+  gboolean pollable;
 
-  gdk_pixbuf_save_to_stream(pixbuf, out, "png", NULL, &error, NULL);
+  /* Set once the first chunk told which decoder to use */
+  png_structp png;
+  png_infop info;
+  GdkPixbufLoader *loader;
 
-  if (error != NULL) {
-    g_warning("unable to save surface to stdout: %s", error->message);
-    g_error_free(error);
+  /* Rows of previous passes of an interlaced PNG, NULL otherwise */
+  guchar *png_rows;
+  gboolean png_done;
+  GError *png_error;
+
+  gboolean closed;
+  /* Area of the image decoded since the last refresh */
+  struct swappy_box damage;
+  guchar buf[PIXBUF_LOAD_BLOCK_SIZE];
+};
+
+static GInputStream *open_input_stream(const char *file, GError **error) {
+  GFileInputStream *in;
+  GFile *gfile;
+
+  if (is_file_from_stdin(file)) {
+    if (isatty(STDIN_FILENO)) {
+      g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                          "stdin is a tty");
+      return NULL;
+    }
+    return g_unix_input_stream_new(STDIN_FILENO, FALSE);
+  }
+
+  gfile = g_file_new_for_path(file);
+  in = g_file_read(gfile, NULL, error);
+  g_object_unref(gfile);
+
+  return G_INPUT_STREAM(in);
+}
+
+static gboolean load_prepare_surface(struct pixbuf_load *load,
+                                     gint image_width, gint image_height) {
+  struct swappy_state *state = load->state;
+  cairo_surface_t *surface = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, image_width, image_height);
+
+  g_debug("size of image being loaded: %dx%d", image_width, image_height);
+
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return FALSE;
+  }
+
+  // Rows not decoded yet are left transparent
+  state->original_image_surface = surface;
+
+  return TRUE;
+}
+
+static void on_png_error(png_structp png, png_const_charp message) {
+  struct pixbuf_load *load = png_get_error_ptr(png);
+
+  if (load->png_error == NULL) {
+    g_set_error(&load->png_error, GDK_PIXBUF_ERROR,
+                GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "unable to decode png: %s",
+                message);
+  }
+
+  png_longjmp(png, 1);
+}
+
+static void on_png_warning(png_structp png, png_const_charp message) {
+  g_debug("png warning: %s", message);
+}
+
+static void on_png_info(png_structp png, png_infop info) {
+  struct pixbuf_load *load = png_get_progressive_ptr(png);
+  png_uint_32 width, height;
+  int bit_depth, color_type, interlace;
+
+  png_get_IHDR(png, info, &width, &height, &bit_depth, &color_type, &interlace,
+               NULL, NULL);
+
+  // Whatever the image is stored as, have rows come as 8 bits RGBA
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+
+  if (png_set_interlace_handling(png) > 1) {
+    load->png_rows = g_try_malloc0_n(height, (gsize)width * 4);
+    if (load->png_rows == NULL) {
+      png_error(png, "image is too large");
+    }
+  }
+
+  png_read_update_info(png, info);
+
+  if (width > G_MAXINT || height > G_MAXINT ||
+      !load_prepare_surface(load, width, height)) {
+    png_error(png, "image is too large");
+  }
+}
+
+static void on_png_row(png_structp png, png_bytep new_row, png_uint_32 row_num,
+                       int pass) {
+  struct pixbuf_load *load = png_get_progressive_ptr(png);
+  cairo_surface_t *surface = load->state->original_image_surface;
+  int width = cairo_image_surface_get_width(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  uint32_t *pixels =
+      (uint32_t *)(cairo_image_surface_get_data(surface) + row_num * stride);
+  struct swappy_box area = {0, row_num, width, 1};
+  const uint8_t *row = new_row;
+
+  // Interlaced rows only hold the pixels of the current pass
+  if (new_row == NULL) {
     return;
   }
 
-  g_object_unref(out);
+  if (load->png_rows) {
+    row = load->png_rows + (gsize)row_num * width * 4;
+    png_progressive_combine_row(png, (png_bytep)row, new_row);
+  }
+
+  // The surface is written behind cairo's back
+  cairo_surface_flush(surface);
+
+  for (int x = 0; x < width; x++) {
+    const uint8_t *p = row + x * 4;
+    uint32_t alpha = p[3];
+
+    if (alpha == 0xff) {
+      pixels[x] = 0xff000000 | p[0] << 16 | p[1] << 8 | p[2];
+    } else {
+      pixels[x] = alpha << 24 | ((p[0] * alpha + 127) / 255) << 16 |
+                  ((p[1] * alpha + 127) / 255) << 8 |
+                  ((p[2] * alpha + 127) / 255);
+    }
+  }
+
+  cairo_surface_mark_dirty_rectangle(surface, 0, row_num, width, 1);
+  union_box(&load->damage, &area, &load->damage);
 }
 
-GdkPixbuf *pixbuf_init_from_file(struct swappy_state *state) {
-  GError *error = NULL;
-  char *file =
-      state->temp_file_str != NULL ? state->temp_file_str : state->file_str;
-  GdkPixbuf *image = gdk_pixbuf_new_from_file(file, &error);
+static void on_png_end(png_structp png, png_infop info) {
+  struct pixbuf_load *load = png_get_progressive_ptr(png);
+
+  load->png_done = TRUE;
+}
+
+static void on_area_prepared(GdkPixbufLoader *loader,
+                             struct pixbuf_load *load) {
+  GdkPixbuf *image = gdk_pixbuf_loader_get_pixbuf(loader);
+
+  if (!load_prepare_surface(load, gdk_pixbuf_get_width(image),
+                            gdk_pixbuf_get_height(image))) {
+    g_warning("unable to create a surface for the image");
+  }
+}
+
+static void on_area_updated(GdkPixbufLoader *loader, gint x, gint y,
+                            gint width, gint height, struct pixbuf_load *load) {
+  struct swappy_state *state = load->state;
+  struct swappy_box area = {x, y, width, height};
+  GdkPixbuf *pixels;
+  cairo_t *cr;
+
+  if (state->original_image_surface == NULL) {
+    return;
+  }
+
+  // Only convert the rows that were just decoded, not the whole image
+  pixels = gdk_pixbuf_new_subpixbuf(gdk_pixbuf_loader_get_pixbuf(loader), x, y,
+                                    width, height);
+
+  cr = cairo_create(state->original_image_surface);
+  gdk_cairo_set_source_pixbuf(cr, pixels, x, y);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_rectangle(cr, x, y, width, height);
+  cairo_fill(cr);
+  cairo_destroy(cr);
+
+  g_object_unref(pixels);
+
+  union_box(&load->damage, &area, &load->damage);
+}
+
+static void load_refresh(struct pixbuf_load *load) {
+  struct swappy_state *state = load->state;
+
+  // Nothing is shown before the first configure event
+  if (!is_empty_box(&load->damage) && state->rendering_surface) {
+    render_image_area(state, &load->damage);
+  }
+
+  load->damage = (struct swappy_box){0};
+}
+
+static gboolean load_init_decoder(struct pixbuf_load *load, gsize count,
+                                  GError **error) {
+  // Screenshots are PNG images, anything else is left to gdk-pixbuf
+  if (png_sig_cmp(load->buf, 0, MIN(count, 8)) != 0) {
+    load->loader = gdk_pixbuf_loader_new();
+    g_signal_connect(load->loader, "area-prepared",
+                     G_CALLBACK(on_area_prepared), load);
+    g_signal_connect(load->loader, "area-updated",
+                     G_CALLBACK(on_area_updated), load);
+    return TRUE;
+  }
+
+  load->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, load, on_png_error,
+                                     on_png_warning);
+  if (load->png) {
+    load->info = png_create_info_struct(load->png);
+  }
+
+  if (!load->info) {
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                "unable to create png decoder");
+    return FALSE;
+  }
+
+  png_set_progressive_read_fn(load->png, load, on_png_info, on_png_row,
+                              on_png_end);
+
+  return TRUE;
+}
+
+static gboolean load_write_png(struct pixbuf_load *load, gsize count,
+                               GError **error) {
+  if (setjmp(png_jmpbuf(load->png))) {
+    g_propagate_error(error, load->png_error);
+    load->png_error = NULL;
+    return FALSE;
+  }
+
+  png_process_data(load->png, load->info, load->buf, count);
+
+  return TRUE;
+}
+
+static gboolean load_write(struct pixbuf_load *load, gsize count,
+                           GError **error) {
+  gboolean written;
+
+  if (!load->png && !load->loader && !load_init_decoder(load, count, error)) {
+    return FALSE;
+  }
+
+  if (load->png) {
+    written = load_write_png(load, count, error);
+  } else {
+    written = gdk_pixbuf_loader_write(load->loader, load->buf, count, error);
+  }
+
+  load_refresh(load);
+
+  return written;
+}
+
+static gboolean load_close(struct pixbuf_load *load, GError **error) {
+  gboolean closed = TRUE;
+
+  load->closed = TRUE;
 
-  if (error != NULL) {
-    g_printerr("unable to load file: %s - reason: %s\n", file, error->message);
+  if (load->loader) {
+    closed = gdk_pixbuf_loader_close(load->loader, error);
+    load_refresh(load);
+  } else if (load->png && !load->png_done) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR,
+                        GDK_PIXBUF_ERROR_CORRUPT_IMAGE, "png is truncated");
+    closed = FALSE;
+  }
+
+  if (closed && load->state->original_image_surface == NULL) {
+    g_set_error_literal(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "no image data");
+    closed = FALSE;
+  }
+
+  return closed;
+}
+
+static void load_free(struct pixbuf_load *load) {
+  if (load->source) {
+    g_source_destroy(load->source);
+    g_source_unref(load->source);
+  }
+
+  if (load->loader) {
+    // Rows still flushed by closing the loader are not wanted anymore
+    g_signal_handlers_disconnect_by_data(load->loader, load);
+    if (!load->closed) {
+      gdk_pixbuf_loader_close(load->loader, NULL);
+    }
+    g_object_unref(load->loader);
+  }
+
+  if (load->png) {
+    png_destroy_read_struct(&load->png, &load->info, NULL);
+  }
+  g_free(load->png_rows);
+  g_clear_error(&load->png_error);
+
+  load->state->load = NULL;
+
+  g_object_unref(load->in);
+  g_free(load);
+}
+
+/*
+ * Decode the `count` bytes read into the buffer, the end of the input when 0.
+ * Returns FALSE once the load is over, it is freed then.
+ */
+static gboolean load_chunk(struct pixbuf_load *load, gssize count,
+                           GError *error) {
+  if (count < 0 || (count > 0 && !load_write(load, count, &error)) ||
+      (count == 0 && !load_close(load, &error))) {
+    // Keep what could be decoded, it is all there is to edit
+    g_warning("unable to load the rest of the image: %s", error->message);
     g_error_free(error);
-    return NULL;
+    load_free(load);
+    return FALSE;
+  }
+
+  if (count == 0) {
+    g_info("image is fully loaded");
+    load_free(load);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean on_input_ready(gpointer user_data) {
+  struct pixbuf_load *load = user_data;
+  GError *error = NULL;
+  gssize count;
+
+  if (load->pollable) {
+    count = g_pollable_input_stream_read_nonblocking(
+        G_POLLABLE_INPUT_STREAM(load->in), load->buf, sizeof(load->buf), NULL,
+        &error);
+
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      g_error_free(error);
+      return G_SOURCE_CONTINUE;
+    }
+  } else {
+    // Files, reading a chunk does not wait for a writer
+    count = g_input_stream_read(load->in, load->buf, sizeof(load->buf), NULL,
+                                &error);
+  }
+
+  return load_chunk(load, count, error) ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static gboolean on_pollable_input_ready(GObject *stream, gpointer user_data) {
+  return on_input_ready(user_data);
+}
+
+/*
+ * Read the rest of the input from the main loop, one chunk per dispatch. No
+ * read is ever pending in between, so pixbuf_wait_loaded() can take over.
+ */
+static void load_read_in_background(struct pixbuf_load *load) {
+  load->pollable =
+      G_IS_POLLABLE_INPUT_STREAM(load->in) &&
+      g_pollable_input_stream_can_poll(G_POLLABLE_INPUT_STREAM(load->in));
+
+  if (load->pollable) {
+    load->source = g_pollable_input_stream_create_source(
+        G_POLLABLE_INPUT_STREAM(load->in), NULL);
+    g_source_set_callback(load->source,
+                          G_SOURCE_FUNC(on_pollable_input_ready), load, NULL);
+  } else {
+    load->source = g_idle_source_new();
+    g_source_set_callback(load->source, on_input_ready, load, NULL);
   }
 
-  state->original_image = image;
-  return image;
+  // Below the redraw priority, so decoded rows show up between chunks
+  g_source_set_priority(load->source, G_PRIORITY_DEFAULT_IDLE);
+  g_source_attach(load->source, NULL);
 }
 
-void pixbuf_save_to_file(GdkPixbuf *pixbuf, char *file) {
+gboolean pixbuf_init_from_file(struct swappy_state *state) {
+  GError *error = NULL;
+  char *file = state->file_str;
+  struct pixbuf_load *load;
+  GInputStream *in;
+  gssize count;
+
+  in = open_input_stream(file, &error);
+  if (in == NULL) {
+    goto error;
+  }
+
+  load = g_new0(struct pixbuf_load, 1);
+  load->state = state;
+  load->in = in;
+  state->load = load;
+
+  // Only wait for the image header, the window can be shown once the size of
+  // the image is known and the rest is decoded from the main loop.
+  while (state->original_image_surface == NULL) {
+    count = g_input_stream_read(in, load->buf, sizeof(load->buf), NULL, &error);
+
+    if (count < 0 || (count > 0 && !load_write(load, count, &error)) ||
+        (count == 0 && !load_close(load, &error))) {
+      load_free(load);
+      goto error;
+    }
+
+    if (count == 0) {
+      load_free(load);
+      return TRUE;
+    }
+  }
+
+  load_read_in_background(load);
+
+  return TRUE;
+
+error:
+  g_printerr("unable to load file: %s - reason: %s\n", file, error->message);
+  g_error_free(error);
+  return FALSE;
+}
+
+gboolean pixbuf_is_loaded(struct swappy_state *state) {
+  return state->load == NULL;
+}
+
+/*
+ * Decode the rest of the image right away, for exports that must not miss
+ * rows. The input is read here until its end, the main loop is not run.
+ */
+void pixbuf_wait_loaded(struct swappy_state *state) {
+  if (state->load) {
+    g_info("decoding the rest of the image before exporting it");
+    g_source_destroy(state->load->source);
+    g_clear_pointer(&state->load->source, g_source_unref);
+  }
+
+  // The load clears state->load once it is freed
+  while (state->load) {
+    struct pixbuf_load *load = state->load;
+    GError *error = NULL;
+    gssize count = g_input_stream_read(load->in, load->buf, sizeof(load->buf),
+                                       NULL, &error);
+
+    load_chunk(load, count, error);
+  }
+}
+
+void pixbuf_save_to_file(struct swappy_state *state,
+                         struct swappy_export *export, char *file) {
   if (g_strcmp0(file, "-") == 0) {
-    pixbuf_save_to_stdout(pixbuf);
+    pixbuf_save_to_stdout(state, export);
   } else {
-    write_file(pixbuf, file);
+    save_in_background(state, export, file);
+  }
+}
+
+void pixbuf_save_wait(struct swappy_state *state) {
+  if (state->save_pool) {
+    g_thread_pool_free(state->save_pool, FALSE, TRUE);
+    state->save_pool = NULL;
   }
 }
 
-void pixbuf_scale_surface_from_widget(struct swappy_state *state,
-                                      GtkWidget *widget) {
-  GtkAllocation *alloc = g_new(GtkAllocation, 1);
-  GdkPixbuf *image = state->original_image;
-  gtk_widget_get_allocation(widget, alloc);
+gboolean pixbuf_scale_surface_from_widget(struct swappy_state *state,
+                                          GtkWidget *widget) {
+  cairo_surface_t *image = state->original_image_surface;
+  cairo_surface_t *rendering_surface = state->rendering_surface;
 
   cairo_format_t format = CAIRO_FORMAT_ARGB32;
-  gint image_width = gdk_pixbuf_get_width(image);
-  gint image_height = gdk_pixbuf_get_height(image);
+  gint image_width = cairo_image_surface_get_width(image);
+  gint image_height = cairo_image_surface_get_height(image);
 
-  cairo_surface_t *original_image_surface =
-      cairo_image_surface_create(format, image_width, image_height);
+  g_info("size of area to render: %ux%u",
+         gtk_widget_get_allocated_width(widget),
+         gtk_widget_get_allocated_height(widget));
 
-  if (!original_image_surface) {
-    g_error("unable to create cairo original surface from pixbuf");
-    goto finish;
-  } else {
-    cairo_t *cr;
-    cr = cairo_create(original_image_surface);
-    gdk_cairo_set_source_pixbuf(cr, image, 0, 0);
-    cairo_paint(cr);
-    cairo_destroy(cr);
+  // Surfaces are at the size of the image whatever the size of the area is,
+  // draw_area_handler takes care of the scaling.
+  if (rendering_surface &&
+      cairo_image_surface_get_width(rendering_surface) == image_width &&
+      cairo_image_surface_get_height(rendering_surface) == image_height) {
+    return FALSE;
   }
 
-  cairo_surface_t *rendering_surface =
+  rendering_surface =
       cairo_image_surface_create(format, image_width, image_height);
 
-  if (!rendering_surface) {
-    g_error("unable to create rendering surface");
-    goto finish;
+  // cairo never returns NULL, failures are reported by an error surface
+  if (cairo_surface_status(rendering_surface) != CAIRO_STATUS_SUCCESS) {
+    g_error("unable to create rendering surface: %s",
+            cairo_status_to_string(cairo_surface_status(rendering_surface)));
   }
 
-  g_info("size of area to render: %ux%u", alloc->width, alloc->height);
+  cairo_surface_t *committed_surface =
+      cairo_image_surface_create(format, image_width, image_height);
 
-finish:
-  if (state->original_image_surface) {
-    cairo_surface_destroy(state->original_image_surface);
-    state->original_image_surface = NULL;
+  if (cairo_surface_status(committed_surface) != CAIRO_STATUS_SUCCESS) {
+    g_error("unable to create committed surface: %s",
+            cairo_status_to_string(cairo_surface_status(committed_surface)));
   }
-  state->original_image_surface = original_image_surface;
 
   if (state->rendering_surface) {
     cairo_surface_destroy(state->rendering_surface);
@@ -134,11 +926,21 @@ finish:
   }
   state->rendering_surface = rendering_surface;
 
-  g_free(alloc);
+  if (state->committed_surface) {
+    cairo_surface_destroy(state->committed_surface);
+    state->committed_surface = NULL;
+  }
+  state->committed_surface = committed_surface;
+  render_invalidate_committed_layer(state);
+
+  return TRUE;
 }
 
 void pixbuf_free(struct swappy_state *state) {
-  if (G_IS_OBJECT(state->original_image)) {
-    g_object_unref(state->original_image);
+  pixbuf_export_unref(state->export);
+  state->export = NULL;
+
+  if (state->load) {
+    load_free(state->load);
   }
 }
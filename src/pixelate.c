@@ -0,0 +1,117 @@
+#include "pixelate.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Side of the blocks in user space pixels */
+#define PIXELATE_BLOCK_SIZE 10
+
+/*
+ * Returns a surface of the (x, y, width, height) area of `surface` where every
+ * block has been replaced by its average color. Blocks start at the top left
+ * corner of the area, the ones on its right and bottom edges may be smaller.
+ *
+ * Each row of blocks is done in one go: source rows are summed line by line,
+ * then the averages are written line by line, so memory is walked in order.
+ */
+cairo_surface_t *pixelate_surface(cairo_surface_t *surface, double x, double y,
+                                  double width, double height) {
+  cairo_surface_t *final;
+  gdouble scale_x, scale_y;
+  uint8_t *src, *dst, *avg;
+  int src_stride, dst_stride;
+  guint32 *sums;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+  if (format != CAIRO_FORMAT_RGB24 && format != CAIRO_FORMAT_ARGB32) {
+    g_warning("source surface format: %d is not supported", format);
+    return NULL;
+  }
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  int src_width = cairo_image_surface_get_width(surface);
+  int src_height = cairo_image_surface_get_height(surface);
+
+  int start_x = CLAMP(x * scale_x, 0, src_width);
+  int start_y = CLAMP(y * scale_y, 0, src_height);
+  int end_x = CLAMP((x + width) * scale_x, 0, src_width);
+  int end_y = CLAMP((y + height) * scale_y, 0, src_height);
+  int w = MAX(end_x - start_x, 0);
+  int h = MAX(end_y - start_y, 0);
+
+  int block_width = MAX((int)round(PIXELATE_BLOCK_SIZE * scale_x), 1);
+  int block_height = MAX((int)round(PIXELATE_BLOCK_SIZE * scale_y), 1);
+
+  final = cairo_image_surface_create(format, w, h);
+
+  if (cairo_surface_status(final)) {
+    cairo_surface_destroy(final);
+    return NULL;
+  }
+
+  cairo_surface_set_device_scale(final, scale_x, scale_y);
+
+  if (w == 0 || h == 0) {
+    return final;
+  }
+
+  int nb_blocks = (w + block_width - 1) / block_width;
+
+  cairo_surface_flush(surface);
+  src = cairo_image_surface_get_data(surface);
+  src_stride = cairo_image_surface_get_stride(surface);
+  dst = cairo_image_surface_get_data(final);
+  dst_stride = cairo_image_surface_get_stride(final);
+
+  sums = g_new(guint32, nb_blocks * 4);
+  avg = g_new(uint8_t, nb_blocks * 4);
+
+  for (int by = 0; by < h; by += block_height) {
+    int rows = MIN(block_height, h - by);
+
+    memset(sums, 0, sizeof(guint32) * nb_blocks * 4);
+
+    for (int i = 0; i < rows; i++) {
+      const uint8_t *s =
+          src + (ptrdiff_t)(start_y + by + i) * src_stride + start_x * 4;
+
+      for (int j = 0; j < w; j++) {
+        guint32 *sum = sums + (j / block_width) * 4;
+        sum[0] += s[j * 4];
+        sum[1] += s[j * 4 + 1];
+        sum[2] += s[j * 4 + 2];
+        sum[3] += s[j * 4 + 3];
+      }
+    }
+
+    for (int b = 0; b < nb_blocks; b++) {
+      guint32 count = rows * MIN(block_width, w - b * block_width);
+      for (int c = 0; c < 4; c++) {
+        avg[b * 4 + c] = (sums[b * 4 + c] + count / 2) / count;
+      }
+    }
+
+    for (int i = 0; i < rows; i++) {
+      uint8_t *d = dst + (ptrdiff_t)(by + i) * dst_stride;
+
+      for (int j = 0; j < w; j++) {
+        memcpy(d + j * 4, avg + (j / block_width) * 4, 4);
+      }
+    }
+  }
+
+  // Mark final surface as dirty since it was altered with custom data.
+  cairo_surface_mark_dirty(final);
+
+  g_free(sums);
+  g_free(avg);
+
+  return final;
+}
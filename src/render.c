@@ -3,169 +3,23 @@
 #include <math.h>
 #include <pango/pangocairo.h>
 
-#include "algebra.h"
+#include "alloc.h"
+#include "blur.h"
+#include "box.h"
+#include "paint.h"
+#include "pixbuf.h"
+#include "pixelate.h"
+#include "render.h"
 #include "swappy.h"
 #include "util.h"
+#include "view.h"
 
 #define pango_layout_t PangoLayout
 #define pango_font_description_t PangoFontDescription
 #define pango_rectangle_t PangoRectangle
 
-/*
- * This code was largely taken from Kristian Høgsberg and Chris Wilson from:
- * https://www.cairographics.org/cookbook/blur.c/
- */
-static cairo_surface_t *blur_surface(cairo_surface_t *surface, double x,
-                                     double y, double width, double height) {
-  cairo_surface_t *dest_surface, *tmp_surface, *final = NULL;
-  cairo_t *cr;
-  int src_width, src_height;
-  int src_stride, dst_stride;
-  guint u, v, w, z;
-  uint8_t *dst, *tmp;
-  uint32_t *s, *d, p;
-  int i, j, k;
-  const int radius = 4;
-  const double sigma = 3.1;
-  struct gaussian_kernel *gaussian = gaussian_kernel(radius, sigma);
-  const int size = gaussian->size;
-  const int half = (int)radius * 2;
-  gdouble scale_x, scale_y;
-  guint sum, pass, nb_passes;
-
-  sum = (guint)gaussian->sum;
-
-  if (cairo_surface_status(surface)) {
-    return NULL;
-  }
-
-  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
-
-  cairo_format_t src_format = cairo_image_surface_get_format(surface);
-  switch (src_format) {
-    case CAIRO_FORMAT_A1:
-    case CAIRO_FORMAT_A8:
-    default:
-      g_warning("source surface format: %d is not supported", src_format);
-      return NULL;
-    case CAIRO_FORMAT_RGB24:
-    case CAIRO_FORMAT_ARGB32:
-      break;
-  }
-
-  src_stride = cairo_image_surface_get_stride(surface);
-  src_width = cairo_image_surface_get_width(surface);
-  src_height = cairo_image_surface_get_height(surface);
-
-  g_assert(src_height >= height);
-  g_assert(src_width >= width);
-
-  dest_surface = cairo_image_surface_create(src_format, src_width, src_height);
-  tmp_surface = cairo_image_surface_create(src_format, src_width, src_height);
-
-  cairo_surface_set_device_scale(dest_surface, scale_x, scale_y);
-  cairo_surface_set_device_scale(tmp_surface, scale_x, scale_y);
-
-  if (cairo_surface_status(dest_surface) || cairo_surface_status(tmp_surface)) {
-    goto cleanup;
-  }
-
-  cr = cairo_create(tmp_surface);
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_paint(cr);
-  cairo_destroy(cr);
-
-  cr = cairo_create(dest_surface);
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_paint(cr);
-  cairo_destroy(cr);
-
-  dst = cairo_image_surface_get_data(dest_surface);
-  tmp = cairo_image_surface_get_data(tmp_surface);
-  dst_stride = cairo_image_surface_get_stride(dest_surface);
-
-  nb_passes = (guint)sqrt(scale_x * scale_y) + 1;
-
-  int start_x = CLAMP(x * scale_x, 0, src_width);
-  int start_y = CLAMP(y * scale_y, 0, src_height);
-
-  int end_x = CLAMP((x + width) * scale_x, 0, src_width);
-  int end_y = CLAMP((y + height) * scale_y, 0, src_height);
-
-  for (pass = 0; pass < nb_passes; pass++) {
-    /* Horizontally blur from dst -> tmp */
-    for (i = start_y; i < end_y; i++) {
-      s = (uint32_t *)(dst + i * src_stride);
-      d = (uint32_t *)(tmp + i * dst_stride);
-      for (j = start_x; j < end_x; j++) {
-        u = v = w = z = 0;
-        for (k = 0; k < size; k++) {
-          gdouble multiplier = gaussian->kernel[k];
-
-          if (j - half + k < 0 || j - half + k >= src_width) {
-            continue;
-          }
-
-          p = s[j - half + k];
-
-          u += ((p >> 24) & 0xff) * multiplier;
-          v += ((p >> 16) & 0xff) * multiplier;
-          w += ((p >> 8) & 0xff) * multiplier;
-          z += ((p >> 0) & 0xff) * multiplier;
-        }
-
-        d[j] = (u / sum << 24) | (v / sum << 16) | (w / sum << 8) | z / sum;
-      }
-    }
-
-    /* Then vertically blur from tmp -> dst */
-    for (i = start_y; i < end_y; i++) {
-      d = (uint32_t *)(dst + i * dst_stride);
-      for (j = start_x; j < end_x; j++) {
-        u = v = w = z = 0;
-        for (k = 0; k < size; k++) {
-          gdouble multiplier = gaussian->kernel[k];
-
-          if (i - half + k < 0 || i - half + k >= src_height) {
-            continue;
-          }
-
-          s = (uint32_t *)(tmp + (i - half + k) * dst_stride);
-          p = s[j];
-
-          u += ((p >> 24) & 0xff) * multiplier;
-          v += ((p >> 16) & 0xff) * multiplier;
-          w += ((p >> 8) & 0xff) * multiplier;
-          z += ((p >> 0) & 0xff) * multiplier;
-        }
-
-        d[j] = (u / sum << 24) | (v / sum << 16) | (w / sum << 8) | z / sum;
-      }
-    }
-  }
-
-  // Mark destination surface as dirty since it was altered with custom data.
-  cairo_surface_mark_dirty(dest_surface);
-
-  final = cairo_image_surface_create(src_format, (int)(width * scale_x),
-                                     (int)(height * scale_y));
-
-  if (cairo_surface_status(final)) {
-    goto cleanup;
-  }
-
-  cairo_surface_set_device_scale(final, scale_x, scale_y);
-  cr = cairo_create(final);
-  cairo_set_source_surface(cr, dest_surface, -x, -y);
-  cairo_paint(cr);
-  cairo_destroy(cr);
-
-cleanup:
-  cairo_surface_destroy(dest_surface);
-  cairo_surface_destroy(tmp_surface);
-  gaussian_kernel_free(gaussian);
-  return final;
-}
+/* Least the blur preview reaches past the selection, in pixels */
+#define BLUR_PREVIEW_MARGIN 64
 
 static void convert_pango_rectangle_to_swappy_box(pango_rectangle_t rectangle,
                                                   struct swappy_box *box) {
@@ -383,6 +237,14 @@ static void render_shape(cairo_t *cr, struct swappy_paint_shape shape) {
   cairo_restore(cr);
 }
 
+static void box_from_extents(double x1, double y1, double x2, double y2,
+                             double margin, struct swappy_box *box) {
+  box->x = floor(MIN(x1, x2) - margin);
+  box->y = floor(MIN(y1, y2) - margin);
+  box->width = ceil(MAX(x1, x2) + margin) - box->x;
+  box->height = ceil(MAX(y1, y2) + margin) - box->y;
+}
+
 static void clear_surface(cairo_t *cr) {
   cairo_save(cr);
   cairo_set_source_rgba(cr, 0, 0, 0, 0);
@@ -391,7 +253,162 @@ static void clear_surface(cairo_t *cr) {
   cairo_restore(cr);
 }
 
-static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
+/*
+ * Paint the low resolution preview of `source` over the blurred area, or its
+ * bounding rectangle if no preview could be computed. The preview only covers
+ * the surroundings of the selection.
+ */
+static void render_blur_preview(cairo_t *cr, struct swappy_paint *paint,
+                                cairo_surface_t *source,
+                                struct swappy_state *state) {
+  struct swappy_paint_blur *blur = &paint->content.blur;
+
+  double x = MIN(blur->from.x, blur->to.x);
+  double y = MIN(blur->from.y, blur->to.y);
+  double w = ABS(blur->from.x - blur->to.x);
+  double h = ABS(blur->from.y - blur->to.y);
+  struct swappy_box box;
+
+  box_from_extents(x, y, x + w, y + h, 0, &box);
+
+  if (blur->preview && !contains_box(&blur->preview_box, &box)) {
+    g_clear_pointer(&blur->preview, cairo_surface_destroy);
+  }
+
+  if (!blur->preview) {
+    // Computed ahead of the selection, so that it can grow a while before the
+    // preview needs to be computed again
+    gint margin = MAX(MAX(box.width, box.height) / 2, BLUR_PREVIEW_MARGIN);
+
+    blur->preview_box.x = box.x - margin;
+    blur->preview_box.y = box.y - margin;
+    blur->preview_box.width = box.width + 2 * margin;
+    blur->preview_box.height = box.height + 2 * margin;
+    blur->preview = blur_surface_preview(source, &blur->preview_box,
+                                         state->config->blur_algorithm,
+                                         state->config->blur_radius);
+  }
+
+  if (blur->preview &&
+      cairo_surface_status(blur->preview) == CAIRO_STATUS_SUCCESS) {
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_clip(cr);
+    cairo_set_source_surface(cr, blur->preview, 0, 0);
+    cairo_paint(cr);
+  } else {
+    // Preview could not be computed, draw bounding rectangle
+    struct swappy_paint_shape rect = {
+        .r = 0,
+        .g = 0.5,
+        .b = 1,
+        .a = 0.5,
+        .w = 5,
+        .from = blur->from,
+        .to = blur->to,
+        .type = SWAPPY_PAINT_MODE_RECTANGLE,
+        .operation = SWAPPY_PAINT_SHAPE_OPERATION_FILL,
+    };
+    render_shape_rectangle(cr, rect);
+  }
+}
+
+/*
+ * A committed blur whose result is not there yet, computed in the background or
+ * waiting for other blurs to be.
+ */
+static gboolean is_blur_pending(struct swappy_paint *paint) {
+  struct swappy_paint_blur *blur = &paint->content.blur;
+
+  return paint->type == SWAPPY_PAINT_MODE_BLUR && !blur->surface &&
+         (blur->job || !blur->cancellable);
+}
+
+/*
+ * Whether blurring `paint` reads pixels from a blur below it that is still
+ * pending, and only shows its preview.
+ */
+static gboolean is_blur_pending_below(struct swappy_state *state,
+                                      struct swappy_paint *paint,
+                                      cairo_surface_t *target) {
+  struct swappy_paint_blur *blur = &paint->content.blur;
+  struct swappy_box area = {0};
+  GList *elem = g_list_find(state->paints, paint);
+
+  // Paints are prepended, the ones below come next
+  for (elem = elem ? elem->next : NULL; elem; elem = elem->next) {
+    struct swappy_paint *below = elem->data;
+    struct swappy_box below_box;
+
+    if (!is_blur_pending(below)) {
+      continue;
+    }
+
+    if (is_empty_box(&area)) {
+      double reach = blur_get_reach(target, state->config->blur_algorithm,
+                                    state->config->blur_radius);
+
+      box_from_extents(blur->from.x, blur->from.y, blur->to.x, blur->to.y,
+                       reach, &area);
+    }
+
+    box_from_extents(below->content.blur.from.x, below->content.blur.from.y,
+                     below->content.blur.to.x, below->content.blur.to.y, 0,
+                     &below_box);
+
+    if (intersect_box(&area, &below_box)) {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+struct render_blur_task {
+  struct swappy_state *state;
+  struct swappy_paint *paint;
+};
+
+static void render_blur_finished(GObject *source_object, GAsyncResult *result,
+                                 gpointer user_data) {
+  struct render_blur_task *task = user_data;
+  struct swappy_state *state = task->state;
+  struct swappy_paint *paint = task->paint;
+  GError *error = NULL;
+
+  cairo_surface_t *blurred = blur_surface_finish(result, &error);
+
+  g_free(task);
+
+  if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+    // Paint was undone or freed, or render_finish_blurs() took the result. It
+    // must not be touched anymore.
+    g_error_free(error);
+    return;
+  }
+
+  // Cancellable is kept on failure, so that the blur is not started again
+  g_clear_pointer(&paint->content.blur.job, blur_job_unref);
+
+  if (error) {
+    g_warning("unable to blur surface: %s", error->message);
+    g_error_free(error);
+    return;
+  }
+
+  g_clear_object(&paint->content.blur.cancellable);
+  paint->content.blur.surface = blurred;
+
+  if (paint->content.blur.preview) {
+    cairo_surface_destroy(paint->content.blur.preview);
+    paint->content.blur.preview = NULL;
+  }
+
+  render_invalidate_committed_layer(state);
+  render_schedule(state);
+}
+
+static void render_blur(cairo_t *cr, struct swappy_paint *paint,
+                        struct swappy_state *state) {
   struct swappy_paint_blur blur = paint->content.blur;
 
   cairo_surface_t *target = cairo_get_target(cr);
@@ -412,58 +429,178 @@ static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
         cairo_paint(cr);
       }
     } else {
-      // Blur surface and reuse it in future passes
-      g_info(
-          "blurring surface on following image coordinates: %.2lf,%.2lf size: "
-          "%.2lfx%.2lf",
-          x, y, w, h);
-      cairo_surface_t *blurred = blur_surface(target, x, y, w, h);
-
-      if (blurred && cairo_surface_status(blurred) == CAIRO_STATUS_SUCCESS) {
-        cairo_set_source_surface(cr, blurred, x, y);
-        cairo_paint(cr);
-        paint->content.blur.surface = blurred;
+      // Blur surface in the background, the committed layer is rebuilt with
+      // the result once it is ready. Until the blurs below are done too, their
+      // previews are in the way and it is not started.
+      if (!blur.cancellable && !is_blur_pending_below(state, paint, target)) {
+        g_info(
+            "blurring surface on following image coordinates: %.2lf,%.2lf "
+            "size: %.2lfx%.2lf",
+            x, y, w, h);
+
+        struct render_blur_task *task = g_new(struct render_blur_task, 1);
+        task->state = state;
+        task->paint = paint;
+
+        paint->content.blur.cancellable = g_cancellable_new();
+        paint->content.blur.job = blur_surface_async(
+            target, x, y, w, h, state->config->blur_algorithm,
+            state->config->blur_radius, state->blur_pool,
+            paint->content.blur.cancellable, render_blur_finished, task);
       }
+
+      render_blur_preview(cr, paint, target, state);
     }
   } else {
-    // Blur not committed yet, draw bounding rectangle
-    struct swappy_paint_shape rect = {
-        .r = 0,
-        .g = 0.5,
-        .b = 1,
-        .a = 0.5,
-        .w = 5,
-        .from = blur.from,
-        .to = blur.to,
-        .type = SWAPPY_PAINT_MODE_RECTANGLE,
-        .operation = SWAPPY_PAINT_SHAPE_OPERATION_FILL,
-    };
-    render_shape_rectangle(cr, rect);
+    // Blur not committed yet, show a low resolution preview of the committed
+    // layer, computed again only when the selection outgrows it
+    render_blur_preview(cr, paint, state->committed_surface, state);
   }
 
   cairo_restore(cr);
 }
 
+static void render_pixelate(cairo_t *cr, struct swappy_paint *paint,
+                            struct swappy_state *state) {
+  struct swappy_paint_pixelate *pixelate = &paint->content.pixelate;
+  cairo_surface_t *surface;
+
+  double x = MIN(pixelate->from.x, pixelate->to.x);
+  double y = MIN(pixelate->from.y, pixelate->to.y);
+  double w = ABS(pixelate->from.x - pixelate->to.x);
+  double h = ABS(pixelate->from.y - pixelate->to.y);
+
+  if (paint->is_committed) {
+    // Pixelate once and reuse the surface in future passes
+    if (!pixelate->surface) {
+      pixelate->surface = pixelate_surface(cairo_get_target(cr), x, y, w, h);
+    }
+    surface = pixelate->surface;
+  } else {
+    // Cheap enough to be redone from the committed layer on every motion
+    surface = pixelate_surface(state->committed_surface, x, y, w, h);
+  }
+
+  if (surface && cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
+    cairo_save(cr);
+    cairo_set_source_surface(cr, surface, x, y);
+    cairo_paint(cr);
+    cairo_restore(cr);
+  }
+
+  if (!paint->is_committed && surface) {
+    cairo_surface_destroy(surface);
+  }
+}
+
 static void render_brush(cairo_t *cr, struct swappy_paint_brush brush) {
   cairo_set_source_rgba(cr, brush.r, brush.g, brush.b, brush.a);
   cairo_set_line_width(cr, brush.w);
   cairo_set_line_join(cr, CAIRO_LINE_JOIN_BEVEL);
 
-  guint l = g_list_length(brush.points);
+  struct swappy_point *points = (struct swappy_point *)brush.points->data;
+  guint l = brush.points->len;
 
   if (l == 1) {
-    struct swappy_point *point = g_list_nth_data(brush.points, 0);
-    cairo_rectangle(cr, point->x, point->y, brush.w, brush.w);
+    cairo_rectangle(cr, points[0].x, points[0].y, brush.w, brush.w);
     cairo_fill(cr);
+  } else if (brush.smooth) {
+    struct swappy_point c1, c2;
+
+    cairo_move_to(cr, points[0].x, points[0].y);
+    for (guint i = 0; i < l - 1; i++) {
+      paint_brush_get_controls(&brush, i, &c1, &c2);
+      cairo_curve_to(cr, c1.x, c1.y, c2.x, c2.y, points[i + 1].x,
+                     points[i + 1].y);
+    }
+    cairo_stroke(cr);
   } else {
-    for (GList *elem = brush.points; elem; elem = elem->next) {
-      struct swappy_point *point = elem->data;
-      cairo_line_to(cr, point->x, point->y);
+    for (guint i = 0; i < l; i++) {
+      cairo_line_to(cr, points[i].x, points[i].y);
     }
     cairo_stroke(cr);
   }
 }
 
+static void get_shape_bounds(struct swappy_paint_shape shape,
+                             struct swappy_box *box) {
+  double dx = fabs(shape.from.x - shape.to.x);
+  double dy = fabs(shape.from.y - shape.to.y);
+
+  switch (shape.type) {
+    case SWAPPY_PAINT_MODE_RECTANGLE:
+    case SWAPPY_PAINT_MODE_ELLIPSE:
+      if (shape.should_center_at_from) {
+        box_from_extents(shape.from.x - dx, shape.from.y - dy,
+                         shape.from.x + dx, shape.from.y + dy, shape.w, box);
+      } else {
+        box_from_extents(shape.from.x, shape.from.y, shape.to.x, shape.to.y,
+                         shape.w, box);
+      }
+      break;
+    case SWAPPY_PAINT_MODE_ARROW:
+      // Arrow head has a radius of 20 scaled by w / 4, see render_shape_arrow
+      box_from_extents(shape.from.x, shape.from.y, shape.to.x, shape.to.y,
+                       5 * shape.w, box);
+      break;
+    default:
+      break;
+  }
+}
+
+static void get_brush_bounds(struct swappy_paint_brush brush,
+                             struct swappy_box *box) {
+  if (!brush.points || brush.points->len == 0) {
+    return;
+  }
+
+  box_from_extents(brush.min.x, brush.min.y, brush.max.x, brush.max.y, brush.w,
+                   box);
+}
+
+/*
+ * Compute the area of the image, in image coordinates, that a paint touches
+ * when it is rendered. Box is left empty when the paint draws nothing.
+ */
+static void get_paint_bounds(struct swappy_paint *paint,
+                             struct swappy_box *box) {
+  box->x = box->y = box->width = box->height = 0;
+
+  if (!paint || !paint->can_draw) {
+    return;
+  }
+
+  switch (paint->type) {
+    case SWAPPY_PAINT_MODE_BLUR:
+      box_from_extents(paint->content.blur.from.x, paint->content.blur.from.y,
+                       paint->content.blur.to.x, paint->content.blur.to.y, 1,
+                       box);
+      break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      box_from_extents(paint->content.pixelate.from.x,
+                       paint->content.pixelate.from.y,
+                       paint->content.pixelate.to.x,
+                       paint->content.pixelate.to.y, 1, box);
+      break;
+    case SWAPPY_PAINT_MODE_BRUSH:
+      get_brush_bounds(paint->content.brush, box);
+      break;
+    case SWAPPY_PAINT_MODE_RECTANGLE:
+    case SWAPPY_PAINT_MODE_ELLIPSE:
+    case SWAPPY_PAINT_MODE_ARROW:
+      get_shape_bounds(paint->content.shape, box);
+      break;
+    case SWAPPY_PAINT_MODE_TEXT:
+      // Text being edited is surrounded by a frame of width 5
+      box_from_extents(paint->content.text.from.x, paint->content.text.from.y,
+                       paint->content.text.to.x, paint->content.text.to.y, 5,
+                       box);
+      break;
+    default:
+      break;
+  }
+}
+
 static void render_image(cairo_t *cr, struct swappy_state *state) {
   cairo_surface_t *surface = state->original_image_surface;
 
@@ -484,7 +621,10 @@ static void render_paint(cairo_t *cr, struct swappy_paint *paint,
   }
   switch (paint->type) {
     case SWAPPY_PAINT_MODE_BLUR:
-      render_blur(cr, paint);
+      render_blur(cr, paint, state);
+      break;
+    case SWAPPY_PAINT_MODE_PIXELATE:
+      render_pixelate(cr, paint, state);
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
       render_brush(cr, paint->content.brush);
@@ -503,27 +643,498 @@ static void render_paint(cairo_t *cr, struct swappy_paint *paint,
   }
 }
 
-static void render_paints(cairo_t *cr, struct swappy_state *state) {
-  for (GList *elem = g_list_last(state->paints); elem; elem = elem->prev) {
+static void render_committed_layer(struct swappy_state *state,
+                                   struct swappy_box *damage) {
+  gint nb_paints = g_list_length(state->paints);
+  gint nb_rendered = state->committed_paints_count;
+  struct swappy_box box;
+  cairo_t *cr;
+
+  if (nb_paints == nb_rendered) {
+    return;
+  }
+
+  cr = cairo_create(state->committed_surface);
+
+  // Layer was invalidated or paints were removed: start over from the image.
+  if (nb_rendered < 0 || nb_paints < nb_rendered) {
+    clear_surface(cr);
+    render_image(cr, state);
+    nb_rendered = 0;
+
+    damage->x = 0;
+    damage->y = 0;
+    damage->width = cairo_image_surface_get_width(state->committed_surface);
+    damage->height = cairo_image_surface_get_height(state->committed_surface);
+  }
+
+  // Paints are prepended, only the most recent ones need to be drawn on top of
+  // what has already been flattened.
+  for (GList *elem = g_list_nth(state->paints, nb_paints - nb_rendered - 1);
+       elem; elem = elem->prev) {
     struct swappy_paint *paint = elem->data;
     render_paint(cr, paint, state);
+    get_paint_bounds(paint, &box);
+    union_box(damage, &box, damage);
+  }
+
+  state->committed_paints_count = nb_paints;
+
+  cairo_destroy(cr);
+}
+
+static gboolean is_drawing_brush(struct swappy_state *state) {
+  return state->temp_paint &&
+         state->temp_paint->type == SWAPPY_PAINT_MODE_BRUSH;
+}
+
+/*
+ * Rasterize the points added to the brush stroke being drawn since the last
+ * frame into brush_layer, so that a frame only rasterizes what changed
+ * whatever the length of the stroke. `box` is set to the area of the layer
+ * that changed.
+ */
+static void render_brush_segments(struct swappy_state *state,
+                                  struct swappy_paint_brush *brush,
+                                  struct swappy_box *box) {
+  struct swappy_point *points = (struct swappy_point *)brush->points->data;
+  guint len = brush->points->len;
+  // First point of the segments added since the last frame
+  guint first = brush->rendered < 2 ? 0 : brush->rendered - 1;
+  double x1 = G_MAXDOUBLE, y1 = G_MAXDOUBLE;
+  double x2 = -G_MAXDOUBLE, y2 = -G_MAXDOUBLE;
+  gboolean in_path = FALSE;
+  cairo_t *cr;
+
+  *box = (struct swappy_box){0};
+
+  if (brush->rendered >= 2 && brush->rendered == len) {
+    return;
   }
 
-  if (state->temp_paint) {
+  if (!state->brush_layer) {
+    cairo_surface_t *surface = state->rendering_surface;
+    state->brush_layer = cairo_image_surface_create(
+        CAIRO_FORMAT_A8, cairo_image_surface_get_width(surface),
+        cairo_image_surface_get_height(surface));
+  }
+
+  cr = cairo_create(state->brush_layer);
+
+  // A new stroke starts from a clean layer, so does one that is no longer a
+  // single point, see render_brush.
+  if (brush->rendered < 2) {
+    struct swappy_box *old = &state->brush_layer_box;
+    cairo_save(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_rectangle(cr, old->x, old->y, old->width, old->height);
+    cairo_fill(cr);
+    cairo_restore(cr);
+    *old = (struct swappy_box){0};
+  }
+
+  for (guint i = first; i < len; i++) {
+    x1 = MIN(x1, points[i].x);
+    y1 = MIN(y1, points[i].y);
+    x2 = MAX(x2, points[i].x);
+    y2 = MAX(y2, points[i].y);
+  }
+
+  box_from_extents(x1, y1, x2, y2, brush->w, box);
+
+  // Only coverage goes to the layer, color is applied when compositing it
+  cairo_set_source_rgba(cr, 0, 0, 0, 1);
+  cairo_set_line_width(cr, brush->w);
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_BEVEL);
+
+  if (len == 1) {
+    cairo_rectangle(cr, points[0].x, points[0].y, brush->w, brush->w);
+    cairo_fill(cr);
+  } else {
+    // Antialiased edges would add up where segments are stroked twice. The
+    // area of the new segments is cleared instead, and every segment reaching
+    // into it is stroked again as a single path, so that it ends up the same
+    // as a stroke of the whole path. Segments are only walked, not stroked.
+    cairo_rectangle(cr, box->x, box->y, box->width, box->height);
+    cairo_clip(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+    for (guint i = 0; i + 1 < len; i++) {
+      struct swappy_box segment;
+
+      box_from_extents(points[i].x, points[i].y, points[i + 1].x,
+                       points[i + 1].y, brush->w, &segment);
+
+      if (i < first && !intersect_box(&segment, box)) {
+        in_path = FALSE;
+        continue;
+      }
+
+      if (!in_path) {
+        cairo_move_to(cr, points[i].x, points[i].y);
+        in_path = TRUE;
+      }
+      cairo_line_to(cr, points[i + 1].x, points[i + 1].y);
+    }
+    cairo_stroke(cr);
+  }
+
+  cairo_destroy(cr);
+
+  union_box(&state->brush_layer_box, box, &state->brush_layer_box);
+
+  brush->rendered = len;
+}
+
+static void render_brush_layer(cairo_t *cr, struct swappy_paint_brush *brush,
+                               struct swappy_state *state) {
+  cairo_set_source_rgba(cr, brush->r, brush->g, brush->b, brush->a);
+  cairo_mask_surface(cr, state->brush_layer, 0, 0);
+}
+
+void render_invalidate_committed_layer(struct swappy_state *state) {
+  state->committed_paints_count = -1;
+}
+
+static void get_display_size(struct swappy_state *state, gint *width,
+                             gint *height) {
+  cairo_surface_t *surface = state->display_surface;
+  gdouble scale_x, scale_y;
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  *width = cairo_image_surface_get_width(surface) / scale_x;
+  *height = cairo_image_surface_get_height(surface) / scale_y;
+}
+
+static void render_display_area(struct swappy_state *state,
+                                struct swappy_box *area) {
+  gint image_width = cairo_image_surface_get_width(state->rendering_surface);
+  gint image_height = cairo_image_surface_get_height(state->rendering_surface);
+  gint display_width, display_height;
+  cairo_t *cr;
+
+  get_display_size(state, &display_width, &display_height);
+
+  cr = cairo_create(state->display_surface);
+  cairo_rectangle(cr, area->x, area->y, area->width, area->height);
+  cairo_clip(cr);
+  cairo_scale(cr, (double)display_width / image_width,
+              (double)display_height / image_height);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, state->rendering_surface, 0, 0);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+}
+
+static void update_display_damage(struct swappy_state *state,
+                                  struct swappy_box *damage) {
+  gint image_width = cairo_image_surface_get_width(state->rendering_surface);
+  gint image_height = cairo_image_surface_get_height(state->rendering_surface);
+  gint display_width, display_height;
+  struct swappy_box area;
+
+  // Nothing is shown before the first configure event
+  if (!state->display_surface) {
+    return;
+  }
+
+  get_display_size(state, &display_width, &display_height);
+
+  double scale_x = (double)display_width / image_width;
+  double scale_y = (double)display_height / image_height;
+
+  // Grow the area by one pixel to account for the filtering applied when
+  // scaling the rendering surface down.
+  gint x1 = MAX(floor(damage->x * scale_x) - 1, 0);
+  gint y1 = MAX(floor(damage->y * scale_y) - 1, 0);
+  gint x2 = ceil((damage->x + damage->width) * scale_x) + 1;
+  gint y2 = ceil((damage->y + damage->height) * scale_y) + 1;
+
+  area.x = x1;
+  area.y = y1;
+  area.width = x2 - x1;
+  area.height = y2 - y1;
+
+  render_display_area(state, &area);
+
+  // Tiles are drawn again on demand, when zoomed in they are what is shown
+  view_invalidate_area(state, damage);
+
+  if (state->view.zoom_level == 0) {
+    gtk_widget_queue_draw_area(state->ui->area, area.x, area.y, area.width,
+                               area.height);
+  }
+}
+
+static void render_state_with_damage(struct swappy_state *state,
+                                     struct swappy_box *damage) {
+  cairo_surface_t *surface = state->rendering_surface;
+  struct swappy_box temp_paint_box;
+  struct swappy_box box;
+  cairo_t *cr;
+
+  render_committed_layer(state, damage);
+
+  get_paint_bounds(state->temp_paint, &temp_paint_box);
+
+  if (is_drawing_brush(state) &&
+      state->temp_paint->content.brush.rendered >= 2) {
+    // The rest of the stroke is already on the rendering surface
+    render_brush_segments(state, &state->temp_paint->content.brush, &box);
+    union_box(damage, &box, damage);
+  } else {
+    if (is_drawing_brush(state)) {
+      render_brush_segments(state, &state->temp_paint->content.brush, &box);
+      union_box(damage, &box, damage);
+    }
+
+    // The temporary paint needs to be erased from where it was and drawn where
+    // it is now.
+    union_box(damage, &state->temp_paint_box, damage);
+    union_box(damage, &temp_paint_box, damage);
+  }
+
+  state->temp_paint_box = temp_paint_box;
+
+  if (is_empty_box(damage)) {
+    return;
+  }
+
+  // An export may still be encoding the surface, then drawing goes to a copy
+  pixbuf_export_detach(state);
+  surface = state->rendering_surface;
+
+  cr = cairo_create(surface);
+  cairo_rectangle(cr, damage->x, damage->y, damage->width, damage->height);
+  cairo_clip(cr);
+
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, state->committed_surface, 0, 0);
+  cairo_paint(cr);
+  cairo_restore(cr);
+
+  if (is_drawing_brush(state)) {
+    render_brush_layer(cr, &state->temp_paint->content.brush, state);
+  } else if (state->temp_paint) {
     render_paint(cr, state->temp_paint, state);
   }
+
+  cairo_destroy(cr);
+
+  // Anything exported before now is stale
+  state->render_generation++;
+
+  // Drawing is finished, scale the damaged area down for the GtkDrawingArea
+  // and notify it that the area needs to be redrawn.
+  update_display_damage(state, damage);
 }
 
 void render_state(struct swappy_state *state) {
-  cairo_surface_t *surface = state->rendering_surface;
-  cairo_t *cr = cairo_create(surface);
+  struct swappy_box damage = state->render_damage;
+
+  // Whatever was scheduled is rendered now, the tick callback stays around
+  // while dragging or for a redraw of the view
+  if (state->render_tick_id && !state->render_dragging &&
+      !state->render_redraw) {
+    gtk_widget_remove_tick_callback(state->ui->area, state->render_tick_id);
+    state->render_tick_id = 0;
+  }
 
-  clear_surface(cr);
-  render_image(cr, state);
-  render_paints(cr, state);
+  state->render_scheduled = FALSE;
+  state->render_damage = (struct swappy_box){0};
+
+  render_state_with_damage(state, &damage);
+}
+
+static gboolean on_frame_clock_tick(GtkWidget *widget,
+                                    GdkFrameClock *frame_clock,
+                                    gpointer user_data) {
+  struct swappy_state *state = user_data;
+  gboolean dragging = state->render_dragging;
+
+  if (!dragging) {
+    state->render_tick_id = 0;
+  }
+
+  if (state->render_scheduled) {
+    ALLOC_CHECK_BEGIN("frame clock tick");
+    render_state(state);
+    ALLOC_CHECK_END();
+  }
+
+  if (state->render_redraw) {
+    state->render_redraw = FALSE;
+    gtk_widget_queue_draw(widget);
+  }
+
+  return dragging ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+/*
+ * Render the state right before the next frame is drawn. Input events come in
+ * much faster than frames are shown, all of those in between are rendered at
+ * once.
+ */
+void render_schedule(struct swappy_state *state) {
+  state->render_scheduled = TRUE;
+
+  if (state->render_tick_id) {
+    return;
+  }
+
+  state->render_tick_id = gtk_widget_add_tick_callback(
+      state->ui->area, on_frame_clock_tick, state, NULL);
+}
+
+/*
+ * Draw the whole area again on the next frame, for changes of the view rather
+ * than of the image. Pointer motion panning the view invalidates the area once
+ * per frame this way.
+ */
+void render_schedule_redraw(struct swappy_state *state) {
+  state->render_redraw = TRUE;
+
+  if (state->render_tick_id) {
+    return;
+  }
+
+  state->render_tick_id = gtk_widget_add_tick_callback(
+      state->ui->area, on_frame_clock_tick, state, NULL);
+}
+
+/*
+ * Keep the tick callback installed until render_drag_end(), scheduling renders
+ * from pointer motion then only sets a flag. Adding a tick callback allocates,
+ * it is done once per drag rather than once per frame.
+ */
+void render_drag_begin(struct swappy_state *state) {
+  state->render_dragging = TRUE;
 
+  if (state->render_tick_id) {
+    return;
+  }
+
+  state->render_tick_id = gtk_widget_add_tick_callback(
+      state->ui->area, on_frame_clock_tick, state, NULL);
+}
+
+void render_drag_end(struct swappy_state *state) {
+  state->render_dragging = FALSE;
+
+  // Otherwise the next tick renders and removes itself
+  if (state->render_tick_id && !state->render_scheduled &&
+      !state->render_redraw) {
+    gtk_widget_remove_tick_callback(state->ui->area, state->render_tick_id);
+    state->render_tick_id = 0;
+  }
+}
+
+/*
+ * Render what is scheduled now, for whatever reads rendering_surface outside
+ * of drawing.
+ */
+void render_flush(struct swappy_state *state) {
+  if (state->render_scheduled) {
+    render_state(state);
+  }
+}
+
+void render_image_area(struct swappy_state *state, struct swappy_box *area) {
+  cairo_t *cr;
+
+  // Paints are flattened on top of the image or the layer is stale anyway,
+  // both need the layer to be rebuilt
+  if (state->committed_paints_count != 0) {
+    render_invalidate_committed_layer(state);
+    render_schedule(state);
+    return;
+  }
+
+  cr = cairo_create(state->committed_surface);
+  cairo_rectangle(cr, area->x, area->y, area->width, area->height);
+  cairo_clip(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  render_image(cr, state);
   cairo_destroy(cr);
 
-  // Drawing is finished, notify the GtkDrawingArea it needs to be redrawn.
-  gtk_widget_queue_draw(state->ui->area);
+  union_box(&state->render_damage, area, &state->render_damage);
+  render_schedule(state);
+}
+
+/*
+ * Until a committed blur is computed in the background, its preview stands in
+ * for it. Wait for those, for the renders whose pixels must be final such as
+ * exports. Blurs that were waiting for the ones below are started on the way.
+ */
+void render_finish_blurs(struct swappy_state *state) {
+  gboolean waited;
+
+  do {
+    waited = FALSE;
+
+    for (GList *elem = state->paints; elem; elem = elem->next) {
+      struct swappy_paint *paint = elem->data;
+      struct swappy_paint_blur *blur = &paint->content.blur;
+      cairo_surface_t *blurred;
+
+      if (paint->type != SWAPPY_PAINT_MODE_BLUR || !blur->job) {
+        continue;
+      }
+
+      blurred = blur_job_wait(blur->job);
+      g_clear_pointer(&blur->job, blur_job_unref);
+
+      // Its callback gets cancelled and leaves the paint alone
+      g_cancellable_cancel(blur->cancellable);
+      waited = TRUE;
+
+      if (!blurred) {
+        // Cancellable is kept, the blur is not started again
+        g_warning("unable to blur surface");
+        continue;
+      }
+
+      g_clear_object(&blur->cancellable);
+      g_clear_pointer(&blur->preview, cairo_surface_destroy);
+      blur->surface = blurred;
+    }
+
+    if (waited) {
+      render_invalidate_committed_layer(state);
+      render_state(state);
+    }
+  } while (waited);
+}
+
+void render_resize_display(struct swappy_state *state, gint width,
+                           gint height, gint scale) {
+  cairo_surface_t *surface = state->display_surface;
+  struct swappy_box area = {0, 0, width, height};
+  gdouble scale_x, scale_y;
+
+  if (surface) {
+    cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+    if (cairo_image_surface_get_width(surface) == width * scale &&
+        cairo_image_surface_get_height(surface) == height * scale &&
+        scale_x == scale) {
+      return;
+    }
+    cairo_surface_destroy(surface);
+  }
+
+  // Pixels of the display surface match the ones of the screen, so that
+  // draw_area_handler only copies it.
+  surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width * scale,
+                                       height * scale);
+  cairo_surface_set_device_scale(surface, scale, scale);
+  state->display_surface = surface;
+
+  render_display_area(state, &area);
+
+  // Zoom levels are relative to the size of the area
+  view_invalidate(state);
 }
@@ -0,0 +1,342 @@
+#include "view.h"
+
+#include <math.h>
+
+#include "box.h"
+#include "render.h"
+
+/* Every level zooms in by this factor, level 0 fits the image in the area */
+#define VIEW_ZOOM_STEP 1.25
+#define VIEW_ZOOM_LEVEL_MAX 24
+
+/* Side of the tiles the zoomed image is rendered to, in area pixels */
+#define VIEW_TILE_SIZE 256
+
+/* Tiles not drawn in the last frame are dropped past this many bytes */
+#define VIEW_TILE_CACHE_SIZE (128 * 1024 * 1024)
+
+/*
+ * Part of the image rendered at the scale of a zoom level. Tiles are keyed by
+ * level and position so that going back to a level reuses what is left of it,
+ * and only the tiles covering a damaged area are rendered again.
+ */
+struct view_tile {
+  gint64 key;
+  gint level;
+  gint x;
+  gint y;
+  cairo_surface_t *surface;
+  gboolean dirty;
+  guint64 last_used;
+};
+
+static gint64 get_tile_key(gint level, gint x, gint y) {
+  return (gint64)level << 56 | (gint64)(x & 0xfffffff) << 28 |
+         (gint64)(y & 0xfffffff);
+}
+
+static void tile_free(struct view_tile *tile) {
+  cairo_surface_destroy(tile->surface);
+  g_free(tile);
+}
+
+static void get_image_size(struct swappy_state *state, gint *width,
+                           gint *height) {
+  *width = cairo_image_surface_get_width(state->original_image_surface);
+  *height = cairo_image_surface_get_height(state->original_image_surface);
+}
+
+static void get_level_scale(struct swappy_state *state, gint level,
+                            gdouble *scale_x, gdouble *scale_y) {
+  GtkWidget *area = state->ui->area;
+  gdouble zoom = pow(VIEW_ZOOM_STEP, level);
+  gint image_width, image_height;
+
+  get_image_size(state, &image_width, &image_height);
+
+  // Level 0 is how draw_area_handler has always shown the image: stretched to
+  // the size of the area.
+  *scale_x = zoom * gtk_widget_get_allocated_width(area) / image_width;
+  *scale_y = zoom * gtk_widget_get_allocated_height(area) / image_height;
+}
+
+/*
+ * Position of the top left corner of the area in the zoomed image, rounded to
+ * whole pixels so that tiles are copied and never resampled.
+ */
+static void get_origin(struct swappy_state *state, gdouble scale_x,
+                       gdouble scale_y, gdouble *origin_x, gdouble *origin_y) {
+  *origin_x = round(state->view.x * scale_x);
+  *origin_y = round(state->view.y * scale_y);
+}
+
+static void view_clamp(struct swappy_state *state) {
+  GtkWidget *area = state->ui->area;
+  gint image_width, image_height;
+  gdouble scale_x, scale_y;
+
+  get_image_size(state, &image_width, &image_height);
+  get_level_scale(state, state->view.zoom_level, &scale_x, &scale_y);
+
+  gdouble max_x = image_width - gtk_widget_get_allocated_width(area) / scale_x;
+  gdouble max_y =
+      image_height - gtk_widget_get_allocated_height(area) / scale_y;
+
+  state->view.x = CLAMP(state->view.x, 0, MAX(max_x, 0));
+  state->view.y = CLAMP(state->view.y, 0, MAX(max_y, 0));
+}
+
+void view_screen_to_image(struct swappy_state *state, gdouble screen_x,
+                          gdouble screen_y, gdouble *image_x,
+                          gdouble *image_y) {
+  gdouble scale_x, scale_y, origin_x, origin_y;
+
+  get_level_scale(state, state->view.zoom_level, &scale_x, &scale_y);
+  get_origin(state, scale_x, scale_y, &origin_x, &origin_y);
+
+  *image_x = (screen_x + origin_x) / scale_x;
+  *image_y = (screen_y + origin_y) / scale_y;
+}
+
+void view_zoom(struct swappy_state *state, gint levels, gdouble screen_x,
+               gdouble screen_y) {
+  gint level = CLAMP(state->view.zoom_level + levels, 0, VIEW_ZOOM_LEVEL_MAX);
+  gdouble image_x, image_y, scale_x, scale_y;
+
+  if (level == state->view.zoom_level) {
+    return;
+  }
+
+  // Keep the point of the image under the pointer where it is
+  view_screen_to_image(state, screen_x, screen_y, &image_x, &image_y);
+  get_level_scale(state, level, &scale_x, &scale_y);
+
+  state->view.zoom_level = level;
+  state->view.x = image_x - screen_x / scale_x;
+  state->view.y = image_y - screen_y / scale_y;
+  view_clamp(state);
+
+  g_debug("zoom level: %d", level);
+
+  gtk_widget_queue_draw(state->ui->area);
+}
+
+void view_pan(struct swappy_state *state, gdouble dx, gdouble dy) {
+  gdouble scale_x, scale_y;
+
+  if (state->view.zoom_level == 0) {
+    return;
+  }
+
+  get_level_scale(state, state->view.zoom_level, &scale_x, &scale_y);
+
+  state->view.x -= dx / scale_x;
+  state->view.y -= dy / scale_y;
+  view_clamp(state);
+
+  render_schedule_redraw(state);
+}
+
+static void render_tile(struct swappy_state *state, struct view_tile *tile) {
+  gdouble scale_x, scale_y;
+  cairo_pattern_t *pattern;
+  cairo_t *cr;
+
+  get_level_scale(state, tile->level, &scale_x, &scale_y);
+
+  cr = cairo_create(tile->surface);
+  cairo_translate(cr, -tile->x * VIEW_TILE_SIZE, -tile->y * VIEW_TILE_SIZE);
+  cairo_scale(cr, scale_x, scale_y);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_surface(cr, state->rendering_surface, 0, 0);
+
+  // Show actual pixels once they are large enough to be told apart
+  pattern = cairo_get_source(cr);
+  cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+  if (scale_x >= 2 && scale_y >= 2) {
+    cairo_pattern_set_filter(pattern, CAIRO_FILTER_NEAREST);
+  }
+
+  cairo_paint(cr);
+  cairo_destroy(cr);
+
+  tile->dirty = FALSE;
+}
+
+static struct view_tile *get_tile(struct swappy_state *state, gint level,
+                                  gint x, gint y) {
+  gint64 key = get_tile_key(level, x, y);
+  struct view_tile *tile;
+  gint scale;
+
+  if (!state->view.tiles) {
+    state->view.tiles = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                              (GDestroyNotify)tile_free);
+  }
+
+  tile = g_hash_table_lookup(state->view.tiles, &key);
+
+  if (!tile) {
+    scale = gtk_widget_get_scale_factor(state->ui->area);
+
+    tile = g_new0(struct view_tile, 1);
+    tile->key = key;
+    tile->level = level;
+    tile->x = x;
+    tile->y = y;
+    tile->dirty = TRUE;
+    tile->surface =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, VIEW_TILE_SIZE * scale,
+                                   VIEW_TILE_SIZE * scale);
+    cairo_surface_set_device_scale(tile->surface, scale, scale);
+
+    g_hash_table_insert(state->view.tiles, &tile->key, tile);
+    state->view.tiles_size +=
+        (gsize)cairo_image_surface_get_stride(tile->surface) *
+        cairo_image_surface_get_height(tile->surface);
+  }
+
+  if (tile->dirty) {
+    render_tile(state, tile);
+  }
+
+  tile->last_used = state->view.frame;
+
+  return tile;
+}
+
+static void trim_tiles(struct swappy_state *state) {
+  GHashTableIter iter;
+  struct view_tile *tile;
+
+  if (state->view.tiles_size <= VIEW_TILE_CACHE_SIZE) {
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, state->view.tiles);
+  while (state->view.tiles_size > VIEW_TILE_CACHE_SIZE &&
+         g_hash_table_iter_next(&iter, NULL, (gpointer *)&tile)) {
+    if (tile->last_used == state->view.frame) {
+      continue;
+    }
+    state->view.tiles_size -=
+        (gsize)cairo_image_surface_get_stride(tile->surface) *
+        cairo_image_surface_get_height(tile->surface);
+    g_hash_table_iter_remove(&iter);
+  }
+}
+
+void view_draw(struct swappy_state *state, cairo_t *cr) {
+  gint image_width, image_height;
+  gdouble scale_x, scale_y, origin_x, origin_y;
+  gdouble x1, y1, x2, y2;
+
+  // The display surface is already at the size of the area
+  if (state->view.zoom_level == 0) {
+    if (state->display_surface) {
+      cairo_set_source_surface(cr, state->display_surface, 0, 0);
+      cairo_paint(cr);
+    }
+    return;
+  }
+
+  if (!state->rendering_surface) {
+    return;
+  }
+
+  get_image_size(state, &image_width, &image_height);
+  get_level_scale(state, state->view.zoom_level, &scale_x, &scale_y);
+  get_origin(state, scale_x, scale_y, &origin_x, &origin_y);
+
+  // Only the tiles covering what needs to be redrawn are looked at
+  cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+
+  gint tx1 = MAX(floor((x1 + origin_x) / VIEW_TILE_SIZE), 0);
+  gint ty1 = MAX(floor((y1 + origin_y) / VIEW_TILE_SIZE), 0);
+  gint tx2 = MIN(ceil((x2 + origin_x) / VIEW_TILE_SIZE),
+                 ceil(image_width * scale_x / VIEW_TILE_SIZE));
+  gint ty2 = MIN(ceil((y2 + origin_y) / VIEW_TILE_SIZE),
+                 ceil(image_height * scale_y / VIEW_TILE_SIZE));
+
+  state->view.frame++;
+
+  cairo_save(cr);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+
+  for (gint ty = ty1; ty < ty2; ty++) {
+    for (gint tx = tx1; tx < tx2; tx++) {
+      struct view_tile *tile = get_tile(state, state->view.zoom_level, tx, ty);
+      gdouble x = tx * VIEW_TILE_SIZE - origin_x;
+      gdouble y = ty * VIEW_TILE_SIZE - origin_y;
+
+      cairo_set_source_surface(cr, tile->surface, x, y);
+      cairo_rectangle(cr, x, y, VIEW_TILE_SIZE, VIEW_TILE_SIZE);
+      cairo_fill(cr);
+    }
+  }
+
+  cairo_restore(cr);
+
+  trim_tiles(state);
+}
+
+void view_invalidate_area(struct swappy_state *state,
+                          struct swappy_box *damage) {
+  GHashTableIter iter;
+  struct view_tile *tile;
+  gdouble scale_x, scale_y, origin_x, origin_y;
+
+  if (state->view.tiles) {
+    g_hash_table_iter_init(&iter, state->view.tiles);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&tile)) {
+      struct swappy_box box;
+
+      if (tile->dirty) {
+        continue;
+      }
+
+      // Area of the image the tile was rendered from, grown by one pixel to
+      // account for filtering
+      get_level_scale(state, tile->level, &scale_x, &scale_y);
+      box.x = floor(tile->x * VIEW_TILE_SIZE / scale_x) - 1;
+      box.y = floor(tile->y * VIEW_TILE_SIZE / scale_y) - 1;
+      box.width = ceil(VIEW_TILE_SIZE / scale_x) + 3;
+      box.height = ceil(VIEW_TILE_SIZE / scale_y) + 3;
+
+      tile->dirty = intersect_box(&box, damage);
+    }
+  }
+
+  // The display surface takes care of level 0
+  if (state->view.zoom_level == 0) {
+    return;
+  }
+
+  get_level_scale(state, state->view.zoom_level, &scale_x, &scale_y);
+  get_origin(state, scale_x, scale_y, &origin_x, &origin_y);
+
+  gint x1 = floor(damage->x * scale_x - origin_x) - 1;
+  gint y1 = floor(damage->y * scale_y - origin_y) - 1;
+  gint x2 = ceil((damage->x + damage->width) * scale_x - origin_x) + 1;
+  gint y2 = ceil((damage->y + damage->height) * scale_y - origin_y) + 1;
+
+  gtk_widget_queue_draw_area(state->ui->area, x1, y1, x2 - x1, y2 - y1);
+}
+
+void view_invalidate(struct swappy_state *state) {
+  if (state->view.tiles) {
+    g_hash_table_remove_all(state->view.tiles);
+    state->view.tiles_size = 0;
+  }
+
+  if (state->original_image_surface) {
+    view_clamp(state);
+  }
+}
+
+void view_free(struct swappy_state *state) {
+  if (state->view.tiles) {
+    g_hash_table_destroy(state->view.tiles);
+    state->view.tiles = NULL;
+  }
+}